@@ -1,11 +1,15 @@
 #include <alloca.h>
+#include <inttypes.h>
+#include <math.h>
 #include <poll.h>
 #include <pthread.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/time.h>
 #include <sys/uio.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include <uuid/uuid.h>
 
@@ -39,27 +43,174 @@ struct cdb2 {
     int async;
     int done_run_stmt;
     int running; /* keep calling cdb2_next_record */
+    int has_row; /* last cdb2_next_record returned a row */
+    int row_gen; /* bumped by row_invalidate; see row() */
+    int read_stmt; /* running statement came from rd_stmt */
     int rc;
     char *sql;
     pthread_mutex_t lock;
     pthread_cond_t cond;
     pthread_t thd;
+
+    int auto_abandon; /* drain() hands off to a drain thread */
+    int abandoned; /* drain_thd needs joining */
+    int draining; /* cleared by drain_thd when done */
+    int drain_rc;
+    int64_t drained_rows;
+    pthread_t drain_thd;
+
+    int id;
+    int flags;
+    int rec_gen; /* last recording this handle was written to */
+    int rec_kind; /* REC_RD/REC_WR of the dispatched async statement */
+    int rec_pending; /* async wr_stmt not recorded until its rows are read */
+    int64_t rec_start;
+    int param_type[MAX_PARAMS];
+    int param_len[MAX_PARAMS];
 };
 
+static int64_t drained_rows_total;
+
 static void clear_params(struct cdb2 *cdb2)
 {
-    for (int i = 1; i <= cdb2->n_params; ++i) {
+    /* named params use [0, n_params), indexed params use [1, n_params] */
+    for (int i = 0; i <= cdb2->n_params && i < MAX_PARAMS; ++i) {
         if (cdb2->param_name[i]) {
             free(cdb2->param_name[i]);
             cdb2->param_name[i] = NULL;
         }
         free(cdb2->param_value[i]);
         cdb2->param_value[i] = NULL;
+        cdb2->param_type[i] = 0;
     }
     cdb2->n_params = 0;
     cdb2_clearbindings(cdb2->db);
 }
 
+/*
+ * Workload capture: while record(path) is active, every statement issued
+ * through rd_stmt/wr_stmt/expect_err is appended to path. The first statement
+ * on a handle in a recording is preceded by a REC_HANDLE entry so replay can
+ * open an equivalent connection. Integers are written in host byte order.
+ *
+ *   header: REC_MAGIC
+ *   REC_HANDLE: u8 kind, u32 id, i32 flags, u16 len, dbname, u16 len, tier
+ *   REC_RD/REC_WR/REC_ERR: u8 kind, u32 handle, i64 start_us, i64 dur_us,
+ *       i32 rc, u32 len, sql, u8 nparams,
+ *       nparams * (u8 index, u8 type, u8 len, name, i32 len (-1: NULL), value)
+ */
+#define REC_MAGIC "LUACDB2R"
+#define REC_HANDLE 'H'
+#define REC_RD 'R'
+#define REC_WR 'W'
+#define REC_ERR 'E'
+
+static struct {
+    pthread_mutex_t lock;
+    FILE *f;
+    int gen;
+    int64_t start;
+} rec = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static int handle_ids;
+
+static int64_t now_us(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec * 1000000LL + t.tv_nsec / 1000;
+}
+
+#define rec_put(v) fwrite(&(v), sizeof(v), 1, rec.f)
+
+static void rec_put_str(const char *s, int wide)
+{
+    size_t len = s ? strlen(s) : 0;
+    if (wide) {
+        uint32_t l = len;
+        rec_put(l);
+    } else {
+        uint8_t l = len > UINT8_MAX ? UINT8_MAX : len;
+        rec_put(l);
+        len = l;
+    }
+    fwrite(s, 1, len, rec.f);
+}
+
+static void record_stmt(struct cdb2 *cdb2, uint8_t kind, const char *sql, int64_t start, int rc)
+{
+    int64_t dur = now_us() - start;
+    pthread_mutex_lock(&rec.lock);
+    if (!rec.f) {
+        pthread_mutex_unlock(&rec.lock);
+        return;
+    }
+    uint32_t id = cdb2->id;
+    if (cdb2->rec_gen != rec.gen) {
+        cdb2->rec_gen = rec.gen;
+        uint8_t k = REC_HANDLE;
+        int32_t flags = cdb2->flags;
+        uint16_t len;
+        rec_put(k);
+        rec_put(id);
+        rec_put(flags);
+        len = strlen(cdb2->dbname);
+        rec_put(len);
+        fwrite(cdb2->dbname, 1, len, rec.f);
+        len = strlen(cdb2->tier);
+        rec_put(len);
+        fwrite(cdb2->tier, 1, len, rec.f);
+    }
+    start -= rec.start;
+    int32_t rc32 = rc;
+    rec_put(kind);
+    rec_put(id);
+    rec_put(start);
+    rec_put(dur);
+    rec_put(rc32);
+    rec_put_str(sql, 1);
+    uint8_t n = 0;
+    for (int i = 0; i <= cdb2->n_params && i < MAX_PARAMS; ++i) {
+        if (cdb2->param_type[i]) ++n;
+    }
+    rec_put(n);
+    for (int i = 0; i <= cdb2->n_params && i < MAX_PARAMS; ++i) {
+        if (!cdb2->param_type[i]) continue;
+        uint8_t idx = i, type = cdb2->param_type[i];
+        int32_t len = cdb2->param_len[i];
+        rec_put(idx);
+        rec_put(type);
+        rec_put_str(cdb2->param_name[i], 0);
+        rec_put(len);
+        if (len > 0) fwrite(cdb2->param_value[i], 1, len, rec.f);
+    }
+    pthread_mutex_unlock(&rec.lock);
+}
+
+static void record_stop(void)
+{
+    pthread_mutex_lock(&rec.lock);
+    if (rec.f) {
+        fclose(rec.f);
+        rec.f = NULL;
+    }
+    pthread_mutex_unlock(&rec.lock);
+}
+
+static int save_bind_index(struct cdb2 *cdb2, int idx, int type, void *val, int len)
+{
+    cdb2->param_type[idx] = type;
+    cdb2->param_len[idx] = val ? len : -1;
+    return cdb2_bind_index(cdb2->db, idx, type, val, len);
+}
+
+static int save_bind_param(struct cdb2 *cdb2, int idx, const char *name, int type, void *val, int len)
+{
+    cdb2->param_type[idx] = type;
+    cdb2->param_len[idx] = val ? len : -1;
+    return cdb2_bind_param(cdb2->db, name, type, val, len);
+}
+
 static int cdb2(Lua L)
 {
     int args = lua_gettop(L);
@@ -86,6 +237,8 @@ static int cdb2(Lua L)
     cdb2->dbname = dbname;
     cdb2->tier = tier;
     cdb2->db = db;
+    cdb2->id = ++handle_ids;
+    cdb2->flags = flags;
     luaL_getmetatable(L, "cdb2");
     lua_setmetatable(L, -2);
     return 1;
@@ -101,9 +254,17 @@ static void *async_worker(void * data)
     pthread_cond_wait(&cdb2->cond, &cdb2->lock);
     while (cdb2->async) {
         pthread_mutex_unlock(&cdb2->lock);
+        int64_t start = now_us();
         cdb2->rc = cdb2_run_statement(cdb2->db, cdb2->sql);
-        free(cdb2->sql);
-        clear_params(cdb2);
+        if (cdb2->rec_kind == REC_WR && cdb2->rc == 0) {
+            /* see record_async_wr */
+            cdb2->rec_pending = 1;
+            cdb2->rec_start = start;
+        } else {
+            record_stmt(cdb2, cdb2->rec_kind, cdb2->sql, start, cdb2->rc);
+            free(cdb2->sql);
+            clear_params(cdb2);
+        }
 
         pthread_mutex_lock(&cdb2->lock);
         cdb2->done_run_stmt = 1;
@@ -153,23 +314,97 @@ static void cdb2_wait(struct cdb2 *cdb2)
     if (!cdb2->done_run_stmt) abort();
 }
 
-static void cdb2_dispatch(Lua L, struct cdb2 *cdb2, const char *sql)
+/* Called wherever a statement starts, moves its cursor or ends */
+static void row_invalidate(struct cdb2 *cdb2)
+{
+    ++cdb2->row_gen;
+    cdb2->has_row = 0;
+}
+
+static void cdb2_dispatch(Lua L, struct cdb2 *cdb2, const char *sql, int kind)
 {
     pthread_mutex_lock(&cdb2->lock);
     if (cdb2->running) {
         luacdb2_error(L, have_active_stmt);
     }
+    row_invalidate(cdb2);
     cdb2->sql = strdup(sql);
+    cdb2->rec_kind = kind;
     cdb2->running = 1;
     cdb2->done_run_stmt = 0;
     pthread_cond_signal(&cdb2->cond);
     pthread_mutex_unlock(&cdb2->lock);
 }
 
+/*
+ * A sync wr_stmt is recorded after it has read its rows, and replay times
+ * run+drain for writes. An async wr_stmt leaves the rows to the script, so
+ * its sql and params are kept until the statement ends and it is recorded
+ * then with the same span.
+ */
+static void record_async_wr(struct cdb2 *cdb2, int rc)
+{
+    if (!cdb2->rec_pending) return;
+    cdb2->rec_pending = 0;
+    if (rc == CDB2_OK_DONE) rc = 0;
+    record_stmt(cdb2, REC_WR, cdb2->sql, cdb2->rec_start, rc);
+    free(cdb2->sql);
+    cdb2->sql = NULL;
+    clear_params(cdb2);
+}
+
+/*
+ * drained_rows counts rows of read statements (rd_stmt/run_statement) that
+ * the script discarded with drain() or abandon(). Rows that wr_stmt reads to
+ * finish a write are not counted: nothing was going to use them.
+ */
+static void count_drained(struct cdb2 *cdb2, int64_t rows)
+{
+    if (!cdb2->read_stmt) return;
+    __atomic_add_fetch(&cdb2->drained_rows, rows, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&drained_rows_total, rows, __ATOMIC_RELAXED);
+}
+
+static void *drain_worker(void *data)
+{
+    struct cdb2 *cdb2 = data;
+    int rc = 0;
+    int64_t rows = 0;
+    if (cdb2->async) {
+        pthread_mutex_lock(&cdb2->lock);
+        cdb2_wait(cdb2);
+        pthread_mutex_unlock(&cdb2->lock);
+        rc = cdb2->rc;
+    }
+    if (rc == 0) {
+        while ((rc = cdb2_next_record(cdb2->db)) == CDB2_OK)
+            ++rows;
+        if (rc == CDB2_OK_DONE) rc = 0;
+    }
+    record_async_wr(cdb2, rc);
+    cdb2->drain_rc = rc;
+    count_drained(cdb2, rows);
+    __atomic_store_n(&cdb2->draining, 0, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/* Block until a background drain started by abandon() is done */
+static void drain_wait(Lua L, struct cdb2 *cdb2)
+{
+    if (!cdb2->abandoned) return;
+    pthread_join(cdb2->drain_thd, NULL);
+    cdb2->abandoned = 0;
+    if (cdb2->drain_rc != 0 && L) {
+        luacdb2_error(L, "background drain rc:%d err:%s", cdb2->drain_rc, cdb2_errstr(cdb2->db));
+    }
+}
+
 static int __gc(Lua L)
 {
-    if (die) return 0;
     struct cdb2 *cdb2 = lua_touserdata(L, -1);
+    /* drain_worker writes into *cdb2; join it before lua_close frees it */
+    drain_wait(NULL, cdb2);
+    if (die) return 0;
     if (cdb2->running) {
         fprintf(stderr,  "closing active statement\n");
     }
@@ -181,6 +416,7 @@ static int __gc(Lua L)
         pthread_mutex_unlock(&cdb2->lock);
 
         pthread_join(cdb2->thd, NULL);
+        if (cdb2->rec_pending) free(cdb2->sql);
         pthread_cond_destroy(&cdb2->cond);
         pthread_mutex_destroy(&cdb2->lock);
     }
@@ -206,6 +442,7 @@ static int __gc(Lua L)
 static int bind_index(Lua L) /* 1-indexed */
 {
     struct cdb2 *cdb2 = luaL_checkudata(L, 1, "cdb2");
+    drain_wait(L, cdb2);
     if (cdb2->running) return luacdb2_error(L, have_active_stmt);
     int idx = lua_tointeger(L, 2);
     if (idx >= MAX_PARAMS) return luacdb2_error(L, "too many params");
@@ -216,26 +453,26 @@ static int bind_index(Lua L) /* 1-indexed */
         if (lua_isinteger(L, -1)) {
             int64_t *val = cdb2->param_value[idx] = malloc(sizeof(int64_t));
             *val = lua_tointeger(L, -1);
-            if (cdb2_bind_index(cdb2->db, idx, CDB2_INTEGER, val, sizeof(*val)) != 0) {
+            if (save_bind_index(cdb2, idx, CDB2_INTEGER, val, sizeof(*val)) != 0) {
                 return luacdb2_error(L, cdb2_errstr(cdb2->db));
             }
         } else if (lua_isnumber(L, -1)) {
             double *val = cdb2->param_value[idx] = malloc(sizeof(double));
             *val = lua_tonumber(L, -1);
-            if (cdb2_bind_index(cdb2->db, idx, CDB2_REAL, val, sizeof(*val)) != 0) {
+            if (save_bind_index(cdb2, idx, CDB2_REAL, val, sizeof(*val)) != 0) {
                 return luacdb2_error(L, cdb2_errstr(cdb2->db));
             }
         }
         break;
     case LUA_TSTRING: {
             char *val = cdb2->param_value[idx] = strdup(lua_tostring(L, -1));
-            if (cdb2_bind_index(cdb2->db, idx, CDB2_CSTRING, val, strlen(val)) != 0) {
+            if (save_bind_index(cdb2, idx, CDB2_CSTRING, val, strlen(val)) != 0) {
                 return luacdb2_error(L, cdb2_errstr(cdb2->db));
             }
         }
         break;
     case LUA_TNIL: {
-            if (cdb2_bind_index(cdb2->db, idx, CDB2_CSTRING, NULL, 0) != 0) {
+            if (save_bind_index(cdb2, idx, CDB2_CSTRING, NULL, 0) != 0) {
                 return luacdb2_error(L, cdb2_errstr(cdb2->db));
             }
         }
@@ -249,6 +486,7 @@ static int bind_index(Lua L) /* 1-indexed */
 static int bind_param(Lua L)
 {
     struct cdb2 *cdb2 = luaL_checkudata(L, 1, "cdb2");
+    drain_wait(L, cdb2);
     if (cdb2->running) return luacdb2_error(L, have_active_stmt);
     if (cdb2->n_params >= MAX_PARAMS) return luacdb2_error(L, "too many params");
     int idx = cdb2->n_params++;
@@ -258,26 +496,26 @@ static int bind_param(Lua L)
         if (lua_isinteger(L, -1)) {
             int64_t *val = cdb2->param_value[idx] = malloc(sizeof(int64_t));
             *val = lua_tointeger(L, -1);
-            if (cdb2_bind_param(cdb2->db, param, CDB2_INTEGER, val, sizeof(*val)) != 0) {
+            if (save_bind_param(cdb2, idx, param, CDB2_INTEGER, val, sizeof(*val)) != 0) {
                 return luacdb2_error(L, cdb2_errstr(cdb2->db));
             }
         } else if (lua_isnumber(L, -1)) {
             double *val = cdb2->param_value[idx] = malloc(sizeof(double));
             *val = lua_tonumber(L, -1);
-            if (cdb2_bind_param(cdb2->db, param, CDB2_REAL, val, sizeof(*val)) != 0) {
+            if (save_bind_param(cdb2, idx, param, CDB2_REAL, val, sizeof(*val)) != 0) {
                 return luacdb2_error(L, cdb2_errstr(cdb2->db));
             }
         }
         break;
     case LUA_TSTRING: {
             char *val = cdb2->param_value[idx] = strdup(lua_tostring(L, -1));
-            if (cdb2_bind_param(cdb2->db, param, CDB2_CSTRING, val, strlen(val)) != 0) {
+            if (save_bind_param(cdb2, idx, param, CDB2_CSTRING, val, strlen(val)) != 0) {
                 return luacdb2_error(L, cdb2_errstr(cdb2->db));
             }
         }
         break;
     case LUA_TNIL: {
-            if (cdb2_bind_param(cdb2->db, param, CDB2_CSTRING, NULL, 0) != 0) {
+            if (save_bind_param(cdb2, idx, param, CDB2_CSTRING, NULL, 0) != 0) {
                 return luacdb2_error(L, cdb2_errstr(cdb2->db));
             }
         }
@@ -331,6 +569,7 @@ static struct iovec hex_to_binary(Lua L, const char *str)
 static int bind_index_blob(Lua L) /* 1-indexed */
 {
     struct cdb2 *cdb2 = luaL_checkudata(L, 1, "cdb2");
+    drain_wait(L, cdb2);
     if (cdb2->running) return luacdb2_error(L, have_active_stmt);
     int idx = lua_tointeger(L, 2);
     if (idx >= MAX_PARAMS) return luacdb2_error(L, "too many params");
@@ -338,7 +577,7 @@ static int bind_index_blob(Lua L) /* 1-indexed */
     if (idx > cdb2->n_params) cdb2->n_params = idx;
     struct iovec blob = hex_to_binary(L, luaL_checkstring(L, 3));
     cdb2->param_value[idx] = blob.iov_base;
-    if (cdb2_bind_index(cdb2->db, idx, CDB2_BLOB, blob.iov_base, blob.iov_len) != 0) {
+    if (save_bind_index(cdb2, idx, CDB2_BLOB, blob.iov_base, blob.iov_len) != 0) {
         return luacdb2_error(L, cdb2_errstr(cdb2->db));
     }
     return 0;
@@ -347,13 +586,14 @@ static int bind_index_blob(Lua L) /* 1-indexed */
 static int bind_param_blob(Lua L)
 {
     struct cdb2 *cdb2 = luaL_checkudata(L, 1, "cdb2");
+    drain_wait(L, cdb2);
     if (cdb2->running) return luacdb2_error(L, have_active_stmt);
     if (cdb2->n_params >= MAX_PARAMS) return luacdb2_error(L, "too many params");
     int idx = cdb2->n_params++;
     char *param = cdb2->param_name[idx] = strdup(lua_tostring(L, 2));
     struct iovec blob = hex_to_binary(L, luaL_checkstring(L, 3));
     cdb2->param_value[idx] = blob.iov_base;
-    if (cdb2_bind_param(cdb2->db, param, CDB2_BLOB, blob.iov_base, blob.iov_len) != 0) {
+    if (save_bind_param(cdb2, idx, param, CDB2_BLOB, blob.iov_base, blob.iov_len) != 0) {
         return luacdb2_error(L, cdb2_errstr(cdb2->db));
     }
     return 0;
@@ -430,6 +670,24 @@ static void push_datetimeus(Lua L, cdb2_client_datetimeus_t *dt)
     lua_pushstring(L, buf);
 }
 
+static int push_value(Lua L, int type, void *val, int size)
+{
+    if (val == NULL) {
+        lua_pushnil(L);
+        return 0;
+    }
+    switch (type) {
+    case CDB2_CSTRING: lua_pushlstring(L, val, size > 0 && ((char *)val)[size - 1] == 0 ? size - 1 : size); break;
+    case CDB2_INTEGER: lua_pushinteger(L, *(int64_t *)val); break;
+    case CDB2_REAL: lua_pushnumber(L, *(double *)val); break;
+    case CDB2_BLOB: binary_to_hex(L, val, size); break;
+    case CDB2_DATETIME: push_datetime(L, val); break;
+    case CDB2_DATETIMEUS: push_datetimeus(L, val); break;
+    default: return -1;
+    }
+    return 0;
+}
+
 static int column_value(Lua L)
 {
     struct cdb2 *cdb2 = luaL_checkudata(L, 1, "cdb2");
@@ -437,26 +695,87 @@ static int column_value(Lua L)
         return luacdb2_error(L, no_active_stmt);
     }
     int column = luaL_checkinteger(L, 2) - 1;
-    if (cdb2_column_value(cdb2->db, column) == NULL) {
+    if (push_value(L, cdb2_column_type(cdb2->db, column), cdb2_column_value(cdb2->db, column), cdb2_column_size(cdb2->db, column)) != 0) {
+        return luacdb2_error(L, "unsupported column type for '%s'", cdb2_column_name(cdb2->db, column));
+    }
+    return 1;
+}
+
+/*
+ * Row views: db:row() returns a view of the current record that converts a
+ * cell only when it is indexed, by column number or name. The view is only
+ * good until the cursor moves or the statement ends; row_invalidate bumps
+ * row_gen on every next_record, drain, abandon, fetch_columns and new
+ * statement.
+ */
+struct row_view {
+    struct cdb2 *cdb2;
+    int gen;
+};
+
+static int row(Lua L)
+{
+    struct cdb2 *cdb2 = luaL_checkudata(L, 1, "cdb2");
+    if (!cdb2->running || !cdb2->has_row) {
+        return luacdb2_error(L, no_active_stmt);
+    }
+    struct row_view *v = lua_newuserdata(L, sizeof(struct row_view));
+    v->cdb2 = cdb2;
+    v->gen = cdb2->row_gen;
+    luaL_getmetatable(L, "cdb2row");
+    lua_setmetatable(L, -2);
+    lua_pushvalue(L, 1);
+    lua_setuservalue(L, -2); /* keep the handle alive while the view is */
+    return 1;
+}
+
+static struct cdb2 *check_row(Lua L)
+{
+    struct row_view *v = luaL_checkudata(L, 1, "cdb2row");
+    struct cdb2 *cdb2 = v->cdb2;
+    if (!cdb2->db || !cdb2->running || !cdb2->has_row || v->gen != cdb2->row_gen) {
+        luacdb2_error(L, "stale row: cursor has moved since db:row()");
+    }
+    return cdb2;
+}
+
+static int row_index(Lua L)
+{
+    struct cdb2 *cdb2 = check_row(L);
+    int ncols = cdb2_numcolumns(cdb2->db);
+    int column = -1;
+    if (lua_isinteger(L, 2)) {
+        column = lua_tointeger(L, 2) - 1;
+    } else if (lua_type(L, 2) == LUA_TSTRING) {
+        const char *name = lua_tostring(L, 2);
+        for (int i = 0; i < ncols; ++i) {
+            if (strcmp(cdb2_column_name(cdb2->db, i), name) == 0) {
+                column = i;
+                break;
+            }
+        }
+    }
+    if (column < 0 || column >= ncols) {
         lua_pushnil(L);
         return 1;
     }
-    switch (cdb2_column_type(cdb2->db, column)) {
-    case CDB2_CSTRING: lua_pushstring(L, cdb2_column_value(cdb2->db, column)); break;
-    case CDB2_INTEGER: lua_pushinteger(L, *(int64_t *)cdb2_column_value(cdb2->db, column)); break;
-    case CDB2_REAL: lua_pushnumber(L, *(double *)cdb2_column_value(cdb2->db, column)); break;
-    case CDB2_BLOB: binary_to_hex(L, cdb2_column_value(cdb2->db, column), cdb2_column_size(cdb2->db, column)); break;
-    case CDB2_DATETIME: push_datetime(L, cdb2_column_value(cdb2->db, column)); break;
-    case CDB2_DATETIMEUS: push_datetimeus(L, cdb2_column_value(cdb2->db, column)); break;
-    default: return luacdb2_error(L, "unsupported column type for '%s'", cdb2_column_name(cdb2->db, column));
+    if (push_value(L, cdb2_column_type(cdb2->db, column), cdb2_column_value(cdb2->db, column), cdb2_column_size(cdb2->db, column)) != 0) {
+        return luacdb2_error(L, "unsupported column type for '%s'", cdb2_column_name(cdb2->db, column));
     }
     return 1;
 }
 
-static int drain(Lua L)
+static int row_len(Lua L)
+{
+    struct cdb2 *cdb2 = check_row(L);
+    lua_pushinteger(L, cdb2_numcolumns(cdb2->db));
+    return 1;
+}
+
+static int drain_int(Lua L, struct cdb2 *cdb2)
 {
-    struct cdb2 *cdb2 = luaL_checkudata(L, 1, "cdb2");
     if (!cdb2->running) return luacdb2_error(L, no_active_stmt);
+    row_invalidate(cdb2);
     if (cdb2->async) {
         pthread_mutex_lock(&cdb2->lock);
         cdb2_wait(cdb2);
@@ -466,45 +785,174 @@ static int drain(Lua L)
         }
     }
     int rc;
+    int64_t rows = 0;
     while ((rc = cdb2_next_record(cdb2->db)) == CDB2_OK)
-        ;
+        ++rows;
+    record_async_wr(cdb2, rc);
+    count_drained(cdb2, rows);
     if (rc != CDB2_OK_DONE) return luacdb2_error(L, "rc:%d err:%s", rc, cdb2_errstr(cdb2->db));
     cdb2->running = 0;
     return 0;
 }
 
-static int get_effects(Lua L)
+static int abandon_int(Lua L, struct cdb2 *cdb2)
+{
+    if (!cdb2->running) return luacdb2_error(L, no_active_stmt);
+    row_invalidate(cdb2);
+    cdb2->draining = 1;
+    if (pthread_create(&cdb2->drain_thd, NULL, drain_worker, cdb2) != 0) {
+        cdb2->draining = 0;
+        return drain_int(L, cdb2);
+    }
+    cdb2->abandoned = 1;
+    cdb2->running = 0;
+    return 0;
+}
+
+static int drain(Lua L)
 {
     struct cdb2 *cdb2 = luaL_checkudata(L, 1, "cdb2");
-    if (cdb2->running) return luacdb2_error(L, have_active_stmt);
-    cdb2_effects_tp e;
-    cdb2_get_effects(cdb2->db, &e);
+    if (cdb2->auto_abandon) return abandon_int(L, cdb2);
+    return drain_int(L, cdb2);
+}
 
-    lua_newtable(L);
-    lua_pushstring(L, "num_inserted");
-    lua_pushinteger(L, e.num_inserted);
-    lua_settable(L, -3);
-    lua_pushstring(L, "num_updated");
-    lua_pushinteger(L, e.num_updated);
-    lua_settable(L, -3);
-    lua_pushstring(L, "num_deleted");
-    lua_pushinteger(L, e.num_deleted);
-    lua_settable(L, -3);
-    return 1;
+/*
+ * Hand the rest of the active statement to a drain thread and return
+ * immediately. The next call that needs the handle waits for the drain to
+ * finish; use busy() to check without blocking.
+ */
+static int abandon(Lua L)
+{
+    struct cdb2 *cdb2 = luaL_checkudata(L, 1, "cdb2");
+    return abandon_int(L, cdb2);
 }
 
-static int last_err(Lua L)
+static int auto_abandon(Lua L)
 {
     struct cdb2 *cdb2 = luaL_checkudata(L, 1, "cdb2");
-    if (cdb2->running) return luacdb2_error(L, have_active_stmt);
-    lua_pushstring(L, cdb2->errstr);
+    cdb2->auto_abandon = lua_isnone(L, 2) || lua_toboolean(L, 2);
+    return 0;
+}
+
+static int busy(Lua L)
+{
+    struct cdb2 *cdb2 = luaL_checkudata(L, 1, "cdb2");
+    lua_pushboolean(L, cdb2->running || __atomic_load_n(&cdb2->draining, __ATOMIC_ACQUIRE));
     return 1;
 }
 
-static int next_record(Lua L)
+static int drained_rows(Lua L)
+{
+    struct cdb2 *cdb2 = luaL_testudata(L, 1, "cdb2");
+    int64_t *rows = cdb2 ? &cdb2->drained_rows : &drained_rows_total;
+    lua_pushinteger(L, __atomic_load_n(rows, __ATOMIC_RELAXED));
+    return 1;
+}
+
+/*
+ * Typed column vectors filled by fetch_columns. Integers and doubles are
+ * stored unboxed; strings and blobs are packed into one buffer with an
+ * offsets array. NULL cells are flagged in nulls[] and stored as 0 so the
+ * kernels below can run over data[] without branching.
+ */
+struct vec {
+    int type; /* CDB2_INTEGER, CDB2_REAL, CDB2_CSTRING, CDB2_BLOB */
+    int sorted;
+    char *name;
+    size_t n;
+    size_t cap;
+    union {
+        int64_t *i;
+        double *d;
+        uint64_t *off; /* n + 1 entries into str */
+        void *ptr;
+    } data;
+    uint8_t *nulls;
+    char *str;
+    size_t str_len;
+    size_t str_cap;
+};
+
+static int vec_grow(struct vec *v)
+{
+    size_t cap = v->cap ? v->cap * 2 : 1024;
+    size_t extra = (v->type == CDB2_CSTRING || v->type == CDB2_BLOB) ? 1 : 0;
+    void *data = realloc(v->data.ptr, (cap + extra) * sizeof(int64_t));
+    if (!data) return -1;
+    v->data.ptr = data;
+    uint8_t *nulls = realloc(v->nulls, cap);
+    if (!nulls) return -1;
+    v->nulls = nulls;
+    v->cap = cap;
+    return 0;
+}
+
+static int vec_push_str(struct vec *v, const char *val, size_t len)
+{
+    if (v->str_len + len > v->str_cap) {
+        size_t cap = v->str_cap ? v->str_cap : 4096;
+        while (cap < v->str_len + len) cap *= 2;
+        char *str = realloc(v->str, cap);
+        if (!str) return -1;
+        v->str = str;
+        v->str_cap = cap;
+    }
+    memcpy(v->str + v->str_len, val, len);
+    v->str_len += len;
+    return 0;
+}
+
+static int vec_append(struct vec *v, cdb2_hndl_tp *db, int col)
+{
+    if (v->n == v->cap && vec_grow(v) != 0) return -1;
+    const void *val = cdb2_column_value(db, col);
+    size_t i = v->n++;
+    v->nulls[i] = val == NULL;
+    switch (v->type) {
+    case CDB2_INTEGER: v->data.i[i] = val ? *(int64_t *)val : 0; break;
+    case CDB2_REAL: v->data.d[i] = val ? *(double *)val : 0; break;
+    default: {
+            size_t len = val ? cdb2_column_size(db, col) : 0;
+            if (v->type == CDB2_CSTRING && len && ((char *)val)[len - 1] == 0) --len;
+            if (len && vec_push_str(v, val, len) != 0) return -1;
+            v->data.off[i + 1] = v->str_len;
+        }
+        break;
+    }
+    return 0;
+}
+
+static int vec_gc(Lua L)
+{
+    struct vec *v = luaL_checkudata(L, 1, "cdb2vec");
+    free(v->name);
+    free(v->data.ptr);
+    free(v->nulls);
+    free(v->str);
+    memset(v, 0, sizeof(*v));
+    return 0;
+}
+
+static struct vec *new_vec(Lua L, int type, const char *name)
+{
+    struct vec *v = lua_newuserdata(L, sizeof(struct vec));
+    memset(v, 0, sizeof(struct vec));
+    v->type = type;
+    v->name = strdup(name ? name : "");
+    luaL_getmetatable(L, "cdb2vec");
+    lua_setmetatable(L, -2);
+    if (type == CDB2_CSTRING || type == CDB2_BLOB) {
+        if (vec_grow(v) != 0) luacdb2_error(L, "fetch_columns: out of memory");
+        v->data.off[0] = 0;
+    }
+    return v;
+}
+
+static int fetch_columns(Lua L)
 {
     struct cdb2 *cdb2 = luaL_checkudata(L, 1, "cdb2");
     if (!cdb2->running) return luacdb2_error(L, no_active_stmt);
+    row_invalidate(cdb2);
     if (cdb2->async) {
         pthread_mutex_lock(&cdb2->lock);
         cdb2_wait(cdb2);
@@ -514,223 +962,1636 @@ static int next_record(Lua L)
         }
     }
     int rc = cdb2_next_record(cdb2->db);
-    if (rc == CDB2_OK) {
-        lua_pushboolean(L, 1);
-    } else if (rc == CDB2_OK_DONE) {
-        cdb2->running = 0;
-        lua_pushboolean(L, 0);
-    } else {
-        cdb2->running = 0;
-        return luacdb2_error(L, cdb2_errstr(cdb2->db));
+    int ncols = cdb2_numcolumns(cdb2->db);
+    struct vec **vecs = alloca(ncols * sizeof(struct vec *));
+    lua_createtable(L, ncols, ncols);
+    for (int col = 0; col < ncols; ++col) {
+        int type = cdb2_column_type(cdb2->db, col);
+        const char *name = cdb2_column_name(cdb2->db, col);
+        switch (type) {
+        case CDB2_INTEGER: case CDB2_REAL: case CDB2_CSTRING: case CDB2_BLOB: break;
+        default:
+            record_async_wr(cdb2, rc);
+            cdb2->running = 0;
+            return luacdb2_error(L, "fetch_columns: unsupported column type for '%s'", name);
+        }
+        vecs[col] = new_vec(L, type, name);
+        lua_pushvalue(L, -1);
+        lua_setfield(L, -3, vecs[col]->name);
+        lua_rawseti(L, -2, col + 1);
     }
+    for (; rc == CDB2_OK; rc = cdb2_next_record(cdb2->db)) {
+        for (int col = 0; col < ncols; ++col) {
+            if (vec_append(vecs[col], cdb2->db, col) != 0) {
+                record_async_wr(cdb2, rc);
+                cdb2->running = 0;
+                return luacdb2_error(L, "fetch_columns: out of memory");
+            }
+        }
+    }
+    record_async_wr(cdb2, rc);
+    cdb2->running = 0;
+    if (rc != CDB2_OK_DONE) return luacdb2_error(L, "rc:%d err:%s", rc, cdb2_errstr(cdb2->db));
     return 1;
 }
 
-static int num_columns(Lua L)
+/*
+ * Kernels: simple counted loops over contiguous arrays so that gcc can
+ * vectorize them; NULLs are masked with bit operations instead of a branch.
+ * The target is built with -fvect-cost-model=dynamic so that -O2 vectorizes
+ * them (see CMakeLists.txt). Packed 64-bit compares need AVX2 on x86-64
+ * and the hash gains from its wider lanes, so min/max and the hash are also
+ * cloned for it. Doubles are compared through an order-preserving integer
+ * key, which keeps the integer kernels and avoids the NaN/signed-zero rules
+ * that stop minpd/maxpd being used.
+ */
+#if defined(__GNUC__) && !defined(__clang__) && defined(__x86_64__)
+#define VEC_KERNEL_AVX2 __attribute__((target_clones("avx2", "default")))
+#else
+#define VEC_KERNEL_AVX2
+#endif
+
+/* wraps modulo 2^64 instead of overflowing */
+static int64_t vec_sum_int(const int64_t *d, size_t n)
 {
-    struct cdb2 *cdb2 = luaL_checkudata(L, 1, "cdb2");
-    if (!cdb2->running) {
-        return luacdb2_error(L, no_active_stmt);
-    }
-    lua_pushinteger(L, cdb2_numcolumns(cdb2->db));
-    return 1;
+    uint64_t s = 0;
+    for (size_t i = 0; i < n; ++i) s += (uint64_t)d[i];
+    return (int64_t)s;
 }
 
-static int rd_stmt_int(Lua L, int fail)
+static double vec_sum_real(const double *d, size_t n)
 {
-    struct cdb2 *cdb2 = luaL_checkudata(L, 1, "cdb2");
-    if (cdb2->running) {
-        return luacdb2_error(L, have_active_stmt);
+    double s0 = 0, s1 = 0, s2 = 0, s3 = 0;
+    size_t i = 0;
+    for (; i + 4 <= n; i += 4) {
+        s0 += d[i];
+        s1 += d[i + 1];
+        s2 += d[i + 2];
+        s3 += d[i + 3];
     }
-    const char *sql = luaL_checkstring(L, 2);
-    if (cdb2->async) {
-        cdb2_dispatch(L, cdb2, sql);
-        lua_pushboolean(L, 1);
-        return 1;
-    }
-    if (cdb2_run_statement(cdb2->db, sql) != 0) {
-        if (fail) return luacdb2_error(L, cdb2_errstr(cdb2->db));
-        fprintf(stderr, "%s\n", cdb2_errstr(cdb2->db));
-        lua_pushboolean(L, 0);
-        return 1;
-    }
-    clear_params(cdb2);
-    cdb2->running = 1;
-    if (fail) return 0;
-    lua_pushboolean(L, 1);
-    return 1;
+    for (; i < n; ++i) s0 += d[i];
+    return (s0 + s1) + (s2 + s3);
 }
 
-static int rd_stmt(Lua L)
+static size_t vec_count_nulls(const uint8_t *nulls, size_t n)
 {
-    return rd_stmt_int(L, 1);
+    size_t c = 0;
+    for (size_t i = 0; i < n; ++i) c += nulls[i];
+    return c;
 }
 
-static int run_statement(Lua L)
+/*
+ * double bits -> int64 with the same order (-inf < -0.0 < 0.0 < inf < NaN).
+ * Every NaN, whatever its sign and payload, is first folded into the
+ * positive quiet NaN so that it sorts above inf.
+ */
+static inline int64_t real_key(const double *d)
 {
-    return rd_stmt_int(L, 1);
+    int64_t b;
+    memcpy(&b, d, sizeof(b));
+    int64_t nan = -(int64_t)((b & INT64_MAX) > 0x7ff0000000000000LL);
+    b = (b & ~nan) | (0x7ff8000000000000LL & nan);
+    return b ^ ((b >> 63) & INT64_MAX);
 }
 
-static int try_rd_stmt(Lua L)
+static double key_real(int64_t k)
 {
-    return rd_stmt_int(L, 0);
+    double d;
+    k ^= (k >> 63) & INT64_MAX;
+    memcpy(&d, &k, sizeof(d));
+    return d;
 }
 
-static int expect_err(Lua L, int expected)
+static VEC_KERNEL_AVX2 int64_t vec_min_int(const int64_t *d, const uint8_t *nulls, size_t n)
 {
-    int rc;
-    struct cdb2 *cdb2 = luaL_checkudata(L, 1, "cdb2");
-    const char *sql = luaL_checkstring(L, 2);
-    if (cdb2->running) {
-            return luacdb2_error(L, have_active_stmt);
+    int64_t m = INT64_MAX;
+    for (size_t i = 0; i < n; ++i) {
+        int64_t mask = -(int64_t)nulls[i];
+        int64_t v = (d[i] & ~mask) | (INT64_MAX & mask);
+        m = v < m ? v : m;
     }
-    rc = cdb2_run_statement(cdb2->db, sql);
-    clear_params(cdb2);
-    if (rc == 0) {
-        while ((rc = cdb2_next_record(cdb2->db)) == CDB2_OK)
-            ;
-        if (rc == CDB2_OK_DONE) {
-            lua_pushboolean(L, 0);
-            return 1;
-        }
+    return m;
+}
+
+static VEC_KERNEL_AVX2 int64_t vec_max_int(const int64_t *d, const uint8_t *nulls, size_t n)
+{
+    int64_t m = INT64_MIN;
+    for (size_t i = 0; i < n; ++i) {
+        int64_t mask = -(int64_t)nulls[i];
+        int64_t v = (d[i] & ~mask) | (INT64_MIN & mask);
+        m = v > m ? v : m;
     }
-    if (rc != expected) {
-        return luacdb2_error(L, "expected:%d rc:%d err:%s", expected, rc, cdb2_errstr(cdb2->db));
+    return m;
+}
+
+static VEC_KERNEL_AVX2 int64_t vec_min_real_key(const double *d, const uint8_t *nulls, size_t n)
+{
+    int64_t m = INT64_MAX;
+    for (size_t i = 0; i < n; ++i) {
+        int64_t mask = -(int64_t)nulls[i];
+        int64_t v = (real_key(&d[i]) & ~mask) | (INT64_MAX & mask);
+        m = v < m ? v : m;
     }
-    free(cdb2->errstr);
-    cdb2->errstr = strdup(cdb2_errstr(cdb2->db));
-    cdb2->running = 0;
-    cdb2_close(cdb2->db);
-    cdb2_open(&cdb2->db, cdb2->dbname, cdb2->tier, 0);
-    lua_pushboolean(L, 1);
-    return 1;
+    return m;
 }
 
-static int duplicate_err(Lua L)
+static VEC_KERNEL_AVX2 int64_t vec_max_real_key(const double *d, const uint8_t *nulls, size_t n)
 {
-    return expect_err(L, CDB2ERR_DUPLICATE);
+    int64_t m = INT64_MIN;
+    for (size_t i = 0; i < n; ++i) {
+        int64_t mask = -(int64_t)nulls[i];
+        int64_t v = (real_key(&d[i]) & ~mask) | (INT64_MIN & mask);
+        m = v > m ? v : m;
+    }
+    return m;
 }
 
-static int verify_err(Lua L)
+static double vec_min_real(const double *d, const uint8_t *nulls, size_t n)
 {
-    return expect_err(L, CDB2ERR_VERIFY_ERROR);
+    return key_real(vec_min_real_key(d, nulls, n));
 }
 
-static int querylimit_err(Lua L)
+static double vec_max_real(const double *d, const uint8_t *nulls, size_t n)
 {
-    return expect_err(L, CDB2ERR_QUERYLIMIT);
+    return key_real(vec_max_real_key(d, nulls, n));
 }
 
-static int readonly_err(Lua L)
+static inline uint64_t mix64(uint64_t x)
 {
-    return expect_err(L, CDB2ERR_READONLY);
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
 }
 
-static int wr_stmt(Lua L)
+#define NULL_HASH 0x6e756c6c6e756c6cULL
+
+static VEC_KERNEL_AVX2 uint64_t vec_hash_words(const void *d, const uint8_t *nulls, size_t n)
 {
-    struct cdb2 *cdb2 = luaL_checkudata(L, 1, "cdb2");
-    if (cdb2->running) {
-        return luacdb2_error(L, have_active_stmt);
+    uint64_t h = 0;
+    for (size_t i = 0; i < n; ++i) {
+        uint64_t w, mask = -(uint64_t)nulls[i];
+        memcpy(&w, (const uint8_t *)d + i * sizeof(w), sizeof(w));
+        h += (mix64(w) & ~mask) | (NULL_HASH & mask);
     }
-    const char *sql = luaL_checkstring(L, 2);
+    return h;
+}
+
+static uint64_t vec_hash_strs(const struct vec *v)
+{
+    uint64_t h = 0;
+    for (size_t i = 0; i < v->n; ++i) {
+        if (v->nulls[i]) {
+            h += NULL_HASH;
+            continue;
+        }
+        uint64_t fnv = 0xcbf29ce484222325ULL;
+        for (uint64_t j = v->data.off[i]; j < v->data.off[i + 1]; ++j) {
+            fnv ^= (uint8_t)v->str[j];
+            fnv *= 0x100000001b3ULL;
+        }
+        h += mix64(fnv);
+    }
+    return h;
+}
+
+static int cmp_int(const void *a, const void *b)
+{
+    int64_t x = *(const int64_t *)a, y = *(const int64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static int cmp_real(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static const struct vec *cmp_str_vec;
+
+static int cmp_str(const void *a, const void *b)
+{
+    const struct vec *v = cmp_str_vec;
+    size_t x = *(const size_t *)a, y = *(const size_t *)b;
+    size_t xl = v->data.off[x + 1] - v->data.off[x];
+    size_t yl = v->data.off[y + 1] - v->data.off[y];
+    int rc = memcmp(v->str + v->data.off[x], v->str + v->data.off[y], xl < yl ? xl : yl);
+    if (rc) return rc;
+    return (xl > yl) - (xl < yl);
+}
+
+/* copy non-NULL 8-byte values of a numeric vector to dst; returns count */
+static size_t vec_compact(void *dst, const struct vec *v)
+{
+    size_t j = 0;
+    for (size_t i = 0; i < v->n; ++i) {
+        if (v->nulls[i]) continue;
+        memcpy((uint8_t *)dst + j++ * sizeof(int64_t), (uint8_t *)v->data.ptr + i * sizeof(int64_t), sizeof(int64_t));
+    }
+    return j;
+}
+
+/* NULLs sort first, as in SQL */
+static int vec_sort(Lua L)
+{
+    struct vec *v = luaL_checkudata(L, 1, "cdb2vec");
+    size_t nulls = vec_count_nulls(v->nulls, v->n);
+    if (v->type == CDB2_INTEGER || v->type == CDB2_REAL) {
+        /* compact from the back so values only move towards the end */
+        size_t j = v->n;
+        for (size_t i = v->n; i-- > 0;) {
+            if (v->nulls[i]) continue;
+            memmove((uint8_t *)v->data.ptr + --j * sizeof(int64_t), (uint8_t *)v->data.ptr + i * sizeof(int64_t), sizeof(int64_t));
+        }
+        memset(v->data.ptr, 0, nulls * sizeof(int64_t));
+        memset(v->nulls, 1, nulls);
+        memset(v->nulls + nulls, 0, v->n - nulls);
+        qsort((uint8_t *)v->data.ptr + nulls * sizeof(int64_t), v->n - nulls, sizeof(int64_t), v->type == CDB2_INTEGER ? cmp_int : cmp_real);
+        v->sorted = 1;
+        lua_settop(L, 1);
+        return 1;
+    }
+    size_t *idx = malloc(v->n * sizeof(size_t) + 1);
+    uint64_t *off = malloc((v->n + 1) * sizeof(uint64_t));
+    char *str = malloc(v->str_len + 1);
+    if (!idx || !off || !str) {
+        free(idx);
+        free(off);
+        free(str);
+        return luacdb2_error(L, "sort: out of memory");
+    }
+    size_t j = nulls;
+    for (size_t i = 0; i < v->n; ++i) {
+        if (!v->nulls[i]) idx[j++] = i;
+    }
+    cmp_str_vec = v;
+    qsort(idx + nulls, v->n - nulls, sizeof(size_t), cmp_str);
+    off[0] = 0;
+    for (size_t i = 0; i < v->n; ++i) {
+        size_t len = 0;
+        if (i >= nulls) {
+            len = v->data.off[idx[i] + 1] - v->data.off[idx[i]];
+            memcpy(str + off[i], v->str + v->data.off[idx[i]], len);
+        }
+        off[i + 1] = off[i] + len;
+    }
+    memset(v->nulls, 1, nulls);
+    memset(v->nulls + nulls, 0, v->n - nulls);
+    memcpy(v->data.off, off, (v->n + 1) * sizeof(uint64_t));
+    free(v->str);
+    v->str = str;
+    v->str_cap = v->str_len + 1;
+    free(off);
+    free(idx);
+    v->sorted = 1;
+    lua_settop(L, 1);
+    return 1;
+}
+
+static int vec_sum(Lua L)
+{
+    struct vec *v = luaL_checkudata(L, 1, "cdb2vec");
+    switch (v->type) {
+    case CDB2_INTEGER: lua_pushinteger(L, vec_sum_int(v->data.i, v->n)); return 1;
+    case CDB2_REAL: lua_pushnumber(L, vec_sum_real(v->data.d, v->n)); return 1;
+    default: return luacdb2_error(L, "sum: not a numeric column '%s'", v->name);
+    }
+}
+
+static int vec_minmax(Lua L, int max)
+{
+    struct vec *v = luaL_checkudata(L, 1, "cdb2vec");
+    if (v->type != CDB2_INTEGER && v->type != CDB2_REAL) {
+        return luacdb2_error(L, "%s: not a numeric column '%s'", max ? "max" : "min", v->name);
+    }
+    if (vec_count_nulls(v->nulls, v->n) == v->n) {
+        lua_pushnil(L);
+    } else if (v->type == CDB2_INTEGER) {
+        lua_pushinteger(L, max ? vec_max_int(v->data.i, v->nulls, v->n) : vec_min_int(v->data.i, v->nulls, v->n));
+    } else {
+        lua_pushnumber(L, max ? vec_max_real(v->data.d, v->nulls, v->n) : vec_min_real(v->data.d, v->nulls, v->n));
+    }
+    return 1;
+}
+
+static int vec_min(Lua L)
+{
+    return vec_minmax(L, 0);
+}
+
+static int vec_max(Lua L)
+{
+    return vec_minmax(L, 1);
+}
+
+static int vec_nulls(Lua L)
+{
+    struct vec *v = luaL_checkudata(L, 1, "cdb2vec");
+    lua_pushinteger(L, vec_count_nulls(v->nulls, v->n));
+    return 1;
+}
+
+/* nearest-rank percentile over non-NULL values; p in [0, 100] */
+static int vec_percentile(Lua L)
+{
+    struct vec *v = luaL_checkudata(L, 1, "cdb2vec");
+    double p = luaL_checknumber(L, 2);
+    if (p < 0 || p > 100) return luaL_argerror(L, 2, "expected 0 <= p <= 100");
+    if (v->type != CDB2_INTEGER && v->type != CDB2_REAL) {
+        return luacdb2_error(L, "percentile: not a numeric column '%s'", v->name);
+    }
+    size_t nulls = vec_count_nulls(v->nulls, v->n);
+    size_t n = v->n - nulls;
+    if (n == 0) {
+        lua_pushnil(L);
+        return 1;
+    }
+    size_t rank = ceil(p / 100 * n);
+    rank = rank ? rank - 1 : 0;
+    if (rank >= n) rank = n - 1;
+    size_t at = nulls + rank;
+    void *sorted = v->data.ptr, *tmp = NULL;
+    if (!v->sorted) {
+        if ((sorted = tmp = malloc(n * sizeof(int64_t))) == NULL) {
+            return luacdb2_error(L, "percentile: out of memory");
+        }
+        vec_compact(tmp, v);
+        qsort(tmp, n, sizeof(int64_t), v->type == CDB2_INTEGER ? cmp_int : cmp_real);
+        at = rank;
+    }
+    if (v->type == CDB2_INTEGER) {
+        lua_pushinteger(L, ((int64_t *)sorted)[at]);
+    } else {
+        lua_pushnumber(L, ((double *)sorted)[at]);
+    }
+    free(tmp);
+    return 1;
+}
+
+/* order-independent: rows may come back from replicas in any order */
+static int vec_hash(Lua L)
+{
+    struct vec *v = luaL_checkudata(L, 1, "cdb2vec");
+    uint64_t h;
+    if (v->type == CDB2_INTEGER || v->type == CDB2_REAL) {
+        h = vec_hash_words(v->data.ptr, v->nulls, v->n);
+    } else {
+        h = vec_hash_strs(v);
+    }
+    lua_pushinteger(L, (lua_Integer)h);
+    return 1;
+}
+
+static int vec_len(Lua L)
+{
+    struct vec *v = luaL_checkudata(L, 1, "cdb2vec");
+    lua_pushinteger(L, v->n);
+    return 1;
+}
+
+static int vec_type(Lua L)
+{
+    struct vec *v = luaL_checkudata(L, 1, "cdb2vec");
+    switch (v->type) {
+    case CDB2_INTEGER: lua_pushstring(L, "integer"); break;
+    case CDB2_REAL: lua_pushstring(L, "double"); break;
+    case CDB2_CSTRING: lua_pushstring(L, "string"); break;
+    default: lua_pushstring(L, "blob"); break;
+    }
+    return 1;
+}
+
+static int vec_name(Lua L)
+{
+    struct vec *v = luaL_checkudata(L, 1, "cdb2vec");
+    lua_pushstring(L, v->name);
+    return 1;
+}
+
+static int vec_index(Lua L)
+{
+    struct vec *v = luaL_checkudata(L, 1, "cdb2vec");
+    if (lua_isinteger(L, 2)) {
+        lua_Integer i = lua_tointeger(L, 2) - 1;
+        if (i < 0 || (size_t)i >= v->n || v->nulls[i]) {
+            lua_pushnil(L);
+            return 1;
+        }
+        switch (v->type) {
+        case CDB2_INTEGER: lua_pushinteger(L, v->data.i[i]); break;
+        case CDB2_REAL: lua_pushnumber(L, v->data.d[i]); break;
+        case CDB2_CSTRING: lua_pushlstring(L, v->str + v->data.off[i], v->data.off[i + 1] - v->data.off[i]); break;
+        default: binary_to_hex(L, v->str + v->data.off[i], v->data.off[i + 1] - v->data.off[i]); break;
+        }
+        return 1;
+    }
+    if (lua_type(L, 2) != LUA_TSTRING) {
+        lua_pushnil(L);
+        return 1;
+    }
+    luaL_getmetatable(L, "cdb2vec");
+    lua_getfield(L, -1, lua_tostring(L, 2));
+    return 1;
+}
+
+/*
+ * parallel_scan: one statement per key range, each run on its own handle by
+ * a producer thread. Rows are copied out of the cdb2 buffer into bounded
+ * per-range rings; the Lua thread either interleaves rings as rows arrive or,
+ * with order_by, k-way merges them through a binary heap on the ring heads.
+ * A k-way merge needs every range streaming at once, so ordered scans
+ * require handles >= #splits rather than silently raising the caller's cap.
+ */
+struct scan_cell {
+    int type;
+    int size;
+    void *val; /* NULL for NULL */
+};
+
+struct scan_row {
+    int ncols;
+    struct scan_cell cells[];
+};
+
+struct scan_bound {
+    int type;
+    int len;
+    void *val;
+};
+
+struct scan_stream {
+    struct scan_bound lo;
+    struct scan_bound hi;
+    struct scan_row **ring;
+    size_t head; /* producer */
+    size_t tail; /* consumer */
+    int done;
+    pthread_cond_t not_full;
+};
+
+struct scan {
+    char *dbname;
+    char *tier;
+    int flags;
+    char *sql;
+    size_t ring_size;
+    int n_streams;
+    struct scan_stream *streams;
+    int n_threads;
+    pthread_t *thds;
+    int next_stream; /* next range for a producer to claim */
+
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    int stop;
+    int rc;
+    char *errstr;
+
+    int ncols;
+    char **names;
+
+    int ordered;
+    char *order_name;
+    int order_col;
+    int order_type; /* of the first head; 0 until resolved */
+    int order_numeric;
+    int desc;
+    int *heap;
+    int heap_n;
+    int started;
+
+    int rr; /* unordered: stream to look at first */
+    int cur_stream;
+    struct scan_row *cur;
+};
+
+/* NUL-terminated and padded so the next cell stays 8-byte aligned */
+#define scan_cell_space(size) (((size_t)(size) + 1 + 7) & ~(size_t)7)
+
+static struct scan_row *scan_copy_row(cdb2_hndl_tp *db, int ncols)
+{
+    size_t sz = sizeof(struct scan_row) + ncols * sizeof(struct scan_cell);
+    for (int i = 0; i < ncols; ++i) {
+        if (cdb2_column_value(db, i)) sz += scan_cell_space(cdb2_column_size(db, i));
+    }
+    struct scan_row *row = malloc(sz);
+    if (!row) return NULL;
+    row->ncols = ncols;
+    char *data = (char *)&row->cells[ncols];
+    for (int i = 0; i < ncols; ++i) {
+        struct scan_cell *c = &row->cells[i];
+        const void *val = cdb2_column_value(db, i);
+        c->type = cdb2_column_type(db, i);
+        c->size = val ? cdb2_column_size(db, i) : 0;
+        c->val = NULL;
+        if (val) {
+            memcpy(data, val, c->size);
+            data[c->size] = 0;
+            c->val = data;
+            data += scan_cell_space(c->size);
+        }
+    }
+    return row;
+}
+
+static void scan_fail(struct scan *scan, int rc, const char *err)
+{
+    pthread_mutex_lock(&scan->lock);
+    if (!scan->rc) {
+        scan->rc = rc;
+        scan->errstr = strdup(err ? err : "");
+    }
+    scan->stop = 1;
+    pthread_cond_broadcast(&scan->not_empty);
+    for (int i = 0; i < scan->n_streams; ++i) {
+        pthread_cond_broadcast(&scan->streams[i].not_full);
+    }
+    pthread_mutex_unlock(&scan->lock);
+}
+
+static int scan_bind(cdb2_hndl_tp *db, const char *name, struct scan_bound *b)
+{
+    return cdb2_bind_param(db, name, b->type, b->val, b->val ? b->len : 0);
+}
+
+/* returns non-zero if the producer should give up its handle */
+static int scan_stream_run(struct scan *scan, struct scan_stream *s, cdb2_hndl_tp *db)
+{
+    int rc;
+    if (scan_bind(db, "lo", &s->lo) != 0 || scan_bind(db, "hi", &s->hi) != 0) {
+        scan_fail(scan, -1, cdb2_errstr(db));
+        return -1;
+    }
+    rc = cdb2_run_statement(db, scan->sql);
+    cdb2_clearbindings(db);
+    int first = 1, ncols = 0;
+    while (rc == 0 && (rc = cdb2_next_record(db)) == CDB2_OK) {
+        if (first) {
+            first = 0;
+            ncols = cdb2_numcolumns(db);
+            pthread_mutex_lock(&scan->lock);
+            if (!scan->names) {
+                scan->names = calloc(ncols, sizeof(char *));
+                for (int i = 0; i < ncols; ++i) scan->names[i] = strdup(cdb2_column_name(db, i));
+                scan->ncols = ncols;
+            }
+            pthread_mutex_unlock(&scan->lock);
+        }
+        struct scan_row *row = scan_copy_row(db, ncols);
+        if (!row) {
+            scan_fail(scan, -1, "parallel_scan: out of memory");
+            return -1;
+        }
+        pthread_mutex_lock(&scan->lock);
+        while (s->head - s->tail == scan->ring_size && !scan->stop) {
+            pthread_cond_wait(&s->not_full, &scan->lock);
+        }
+        if (scan->stop) {
+            pthread_mutex_unlock(&scan->lock);
+            free(row);
+            return -1;
+        }
+        s->ring[s->head++ % scan->ring_size] = row;
+        pthread_cond_signal(&scan->not_empty);
+        pthread_mutex_unlock(&scan->lock);
+    }
+    if (rc != CDB2_OK_DONE) {
+        scan_fail(scan, rc, cdb2_errstr(db));
+        return -1;
+    }
+    pthread_mutex_lock(&scan->lock);
+    s->done = 1;
+    pthread_cond_signal(&scan->not_empty);
+    pthread_mutex_unlock(&scan->lock);
+    return 0;
+}
+
+static void *scan_worker(void *data)
+{
+    struct scan *scan = data;
+    cdb2_hndl_tp *db = NULL;
+    if (cdb2_open(&db, scan->dbname, scan->tier, scan->flags) != 0 || !db) {
+        scan_fail(scan, -1, cdb2_errstr(db));
+        if (db) cdb2_close(db);
+        return NULL;
+    }
+    while (1) {
+        pthread_mutex_lock(&scan->lock);
+        int i = scan->stop ? scan->n_streams : scan->next_stream++;
+        pthread_mutex_unlock(&scan->lock);
+        if (i >= scan->n_streams) break;
+        if (scan_stream_run(scan, &scan->streams[i], db) != 0) break;
+    }
+    cdb2_close(db);
+    return NULL;
+}
+
+static int scan_cell_cmp(const struct scan_cell *a, const struct scan_cell *b)
+{
+    if (!a->val || !b->val) return (a->val != NULL) - (b->val != NULL); /* NULLs first */
+    if (a->type == CDB2_INTEGER && b->type == CDB2_INTEGER) {
+        int64_t x = *(int64_t *)a->val, y = *(int64_t *)b->val;
+        return (x > y) - (x < y);
+    }
+    if (a->type == CDB2_REAL || b->type == CDB2_REAL) {
+        double x = a->type == CDB2_REAL ? *(double *)a->val : *(int64_t *)a->val;
+        double y = b->type == CDB2_REAL ? *(double *)b->val : *(int64_t *)b->val;
+        return (x > y) - (x < y);
+    }
+    /* strings and blobs; scan_resolve_order rejects every other type */
+    int rc = memcmp(a->val, b->val, a->size < b->size ? a->size : b->size);
+    if (rc) return rc;
+    return (a->size > b->size) - (a->size < b->size);
+}
+
+static struct scan_row *scan_head(struct scan *scan, int i)
+{
+    struct scan_stream *s = &scan->streams[i];
+    return s->ring[s->tail % scan->ring_size];
+}
+
+/* ties go to the lower range so equal keys keep split order */
+static int scan_less(struct scan *scan, int a, int b)
+{
+    int c = scan->order_col;
+    int rc = scan_cell_cmp(&scan_head(scan, a)->cells[c], &scan_head(scan, b)->cells[c]);
+    if (scan->desc) rc = -rc;
+    return rc < 0 || (rc == 0 && a < b);
+}
+
+static void scan_heap_push(struct scan *scan, int stream)
+{
+    int *h = scan->heap;
+    int i = scan->heap_n++;
+    h[i] = stream;
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (!scan_less(scan, h[i], h[parent])) break;
+        int tmp = h[i];
+        h[i] = h[parent];
+        h[parent] = tmp;
+        i = parent;
+    }
+}
+
+static int scan_heap_pop(struct scan *scan)
+{
+    int *h = scan->heap;
+    int top = h[0];
+    h[0] = h[--scan->heap_n];
+    int i = 0;
+    while (1) {
+        int l = 2 * i + 1, r = l + 1, m = i;
+        if (l < scan->heap_n && scan_less(scan, h[l], h[m])) m = l;
+        if (r < scan->heap_n && scan_less(scan, h[r], h[m])) m = r;
+        if (m == i) break;
+        int tmp = h[i];
+        h[i] = h[m];
+        h[m] = tmp;
+        i = m;
+    }
+    return top;
+}
+
+static struct scan_row *scan_take(struct scan *scan, int i)
+{
+    struct scan_stream *s = &scan->streams[i];
+    struct scan_row *row = s->ring[s->tail++ % scan->ring_size];
+    pthread_cond_signal(&s->not_full);
+    return row;
+}
+
+/* wait until stream i has a row or is finished; called with lock held */
+static int scan_wait_stream(struct scan *scan, int i)
+{
+    struct scan_stream *s = &scan->streams[i];
+    while (s->head == s->tail && !s->done && !scan->rc) {
+        pthread_cond_wait(&scan->not_empty, &scan->lock);
+    }
+    return s->head != s->tail;
+}
+
+/*
+ * Checked on every split's head: 0, -1 if there is no such column, or -2 if
+ * scan_cell_cmp can't order its type (anything but integer, real, string and
+ * blob, or numbers in one split and strings/blobs in another).
+ */
+static int scan_resolve_order(struct scan *scan, int i)
+{
+    for (int j = 0; scan->order_name && scan->order_col < 0 && j < scan->ncols; ++j) {
+        if (strcmp(scan->names[j], scan->order_name) == 0) scan->order_col = j;
+    }
+    if (scan->order_col < 0 || scan->order_col >= scan->ncols) return -1;
+    int type = scan_head(scan, i)->cells[scan->order_col].type;
+    int numeric = type == CDB2_INTEGER || type == CDB2_REAL;
+    if (!numeric && type != CDB2_CSTRING && type != CDB2_BLOB) return -2;
+    if (scan->order_type && scan->order_numeric != numeric) return -2;
+    scan->order_type = type;
+    scan->order_numeric = numeric;
+    return 0;
+}
+
+static int scan_next_ordered(struct scan *scan)
+{
+    if (!scan->started) {
+        scan->started = 1;
+        for (int i = 0; i < scan->n_streams; ++i) {
+            if (!scan_wait_stream(scan, i)) continue;
+            int rc = scan_resolve_order(scan, i);
+            if (rc != 0) return rc;
+            scan_heap_push(scan, i);
+        }
+    } else if (scan->cur_stream >= 0 && scan_wait_stream(scan, scan->cur_stream)) {
+        scan_heap_push(scan, scan->cur_stream);
+    }
+    if (scan->rc || scan->heap_n == 0) return 0;
+    scan->cur_stream = scan_heap_pop(scan);
+    scan->cur = scan_take(scan, scan->cur_stream);
+    return 1;
+}
+
+static int scan_next_unordered(struct scan *scan)
+{
+    while (!scan->rc) {
+        int done = 1;
+        for (int j = 0; j < scan->n_streams; ++j) {
+            int i = (scan->rr + j) % scan->n_streams;
+            struct scan_stream *s = &scan->streams[i];
+            if (s->head != s->tail) {
+                scan->rr = i + 1;
+                scan->cur = scan_take(scan, i);
+                return 1;
+            }
+            if (!s->done) done = 0;
+        }
+        if (done) return 0;
+        pthread_cond_wait(&scan->not_empty, &scan->lock);
+    }
+    return 0;
+}
+
+static void scan_free(struct scan *scan)
+{
+    pthread_mutex_lock(&scan->lock);
+    scan->stop = 1;
+    for (int i = 0; i < scan->n_streams; ++i) {
+        pthread_cond_broadcast(&scan->streams[i].not_full);
+    }
+    pthread_mutex_unlock(&scan->lock);
+    for (int i = 0; i < scan->n_threads; ++i) {
+        pthread_join(scan->thds[i], NULL);
+    }
+    for (int i = 0; i < scan->n_streams; ++i) {
+        struct scan_stream *s = &scan->streams[i];
+        while (s->tail != s->head) free(s->ring[s->tail++ % scan->ring_size]);
+        free(s->ring);
+        free(s->lo.val);
+        free(s->hi.val);
+        pthread_cond_destroy(&s->not_full);
+    }
+    for (int i = 0; i < scan->ncols; ++i) free(scan->names[i]);
+    free(scan->names);
+    free(scan->cur);
+    free(scan->streams);
+    free(scan->thds);
+    free(scan->heap);
+    free(scan->dbname);
+    free(scan->tier);
+    free(scan->sql);
+    free(scan->order_name);
+    free(scan->errstr);
+    pthread_cond_destroy(&scan->not_empty);
+    pthread_mutex_destroy(&scan->lock);
+    free(scan);
+}
+
+static void scan_get_bound(Lua L, int idx, struct scan_bound *b)
+{
+    switch (lua_type(L, idx)) {
+    case LUA_TNUMBER:
+        if (lua_isinteger(L, idx)) {
+            b->type = CDB2_INTEGER;
+            b->len = sizeof(int64_t);
+            b->val = malloc(b->len);
+            *(int64_t *)b->val = lua_tointeger(L, idx);
+        } else {
+            b->type = CDB2_REAL;
+            b->len = sizeof(double);
+            b->val = malloc(b->len);
+            *(double *)b->val = lua_tonumber(L, idx);
+        }
+        break;
+    case LUA_TSTRING:
+        b->type = CDB2_CSTRING;
+        b->val = strdup(lua_tostring(L, idx));
+        b->len = strlen(b->val);
+        break;
+    default:
+        /* a NULL bound would make "id >= @lo" match nothing and skip the range */
+        luaL_argerror(L, 1, "split bounds must be numbers or strings");
+    }
+}
+
+static const char *scan_opt_string(Lua L, const char *key, const char *def)
+{
+    lua_getfield(L, 1, key);
+    const char *val = lua_isnil(L, -1) ? def : luaL_checkstring(L, -1);
+    lua_pop(L, 1);
+    return val;
+}
+
+/*
+ * parallel_scan{db=, tier=, sql_template=, splits={{lo, hi}, ...}, handles=,
+ *               order_by=, desc=, buffer=}
+ * sql_template is run once per split with @lo and @hi bound to its bounds.
+ */
+static int parallel_scan(Lua L)
+{
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_settop(L, 1);
+    const char *dbname = scan_opt_string(L, "db", NULL);
+    const char *tier = scan_opt_string(L, "tier", "default");
+    const char *sql = scan_opt_string(L, "sql_template", NULL);
+    if (!dbname) return luaL_argerror(L, 1, "db expected");
+    if (!sql) return luaL_argerror(L, 1, "sql_template expected");
+    lua_getfield(L, 1, "splits"); /* 2 */
+    if (!lua_istable(L, -1) || lua_rawlen(L, -1) == 0) return luaL_argerror(L, 1, "splits expected");
+    int n = lua_rawlen(L, -1);
+    lua_getfield(L, 1, "handles");
+    int handles = luaL_optinteger(L, -1, n);
+    lua_getfield(L, 1, "buffer");
+    int ring_size = luaL_optinteger(L, -1, 1024);
+    lua_getfield(L, 1, "order_by"); /* 5 */
+    int order_type = lua_type(L, -1);
+    lua_getfield(L, 1, "desc");
+    int desc = lua_toboolean(L, -1);
+    if (handles < 1 || ring_size < 1) return luaL_argerror(L, 1, "handles and buffer must be positive");
+
+    struct scan *scan = calloc(1, sizeof(struct scan));
+    struct scan **ud = lua_newuserdata(L, sizeof(struct scan *));
+    *ud = scan;
+    luaL_getmetatable(L, "cdb2scan");
+    lua_setmetatable(L, -2);
+    pthread_mutex_init(&scan->lock, NULL);
+    pthread_cond_init(&scan->not_empty, NULL);
+    scan->ring_size = ring_size;
+    scan->streams = calloc(n, sizeof(struct scan_stream));
+    for (int i = 0; i < n; ++i) {
+        pthread_cond_init(&scan->streams[i].not_full, NULL);
+    }
+    scan->n_streams = n;
+    scan->order_col = -1;
+    scan->cur_stream = -1;
+    scan->desc = desc;
+    if (order_type == LUA_TNUMBER) {
+        scan->ordered = 1;
+        scan->order_col = lua_tointeger(L, 5) - 1;
+        if (scan->order_col < 0) return luaL_argerror(L, 1, "bad order_by column");
+    } else if (order_type == LUA_TSTRING) {
+        scan->ordered = 1;
+        scan->order_name = strdup(lua_tostring(L, 5));
+    } else if (order_type != LUA_TNIL) {
+        return luaL_argerror(L, 1, "order_by expects column name or number");
+    }
+    if (scan->ordered && handles < n) {
+        return luaL_argerror(L, 1, "order_by merges all splits at once: needs handles >= #splits");
+    }
+    for (int i = 0; i < n; ++i) {
+        lua_rawgeti(L, 2, i + 1);
+        if (!lua_istable(L, -1)) return luaL_argerror(L, 1, "splits expects {lo, hi} pairs");
+        lua_rawgeti(L, -1, 1);
+        scan_get_bound(L, -1, &scan->streams[i].lo);
+        lua_rawgeti(L, -2, 2);
+        scan_get_bound(L, -1, &scan->streams[i].hi);
+        lua_pop(L, 3);
+        scan->streams[i].ring = malloc(ring_size * sizeof(struct scan_row *));
+    }
+    scan->sql = strdup(sql);
+    scan->dbname = strdup(dbname);
+    if (tier[0] == '@' && strchr(tier, ',') == NULL) {
+        scan->flags |= CDB2_DIRECT_CPU;
+        ++tier;
+    }
+    scan->tier = strdup(tier);
+    if (scan->ordered) {
+        scan->heap = malloc(n * sizeof(int));
+    }
+    if (handles > n) {
+        handles = n;
+    }
+    scan->thds = malloc(handles * sizeof(pthread_t));
+    for (int i = 0; i < handles; ++i) {
+        if (pthread_create(&scan->thds[i], NULL, scan_worker, scan) != 0) {
+            scan_fail(scan, -1, "pthread_create failed");
+            break;
+        }
+        ++scan->n_threads;
+    }
+    return 1;
+}
+
+static struct scan *check_scan(Lua L)
+{
+    struct scan **ud = luaL_checkudata(L, 1, "cdb2scan");
+    if (!*ud) luacdb2_error(L, "parallel_scan: closed");
+    return *ud;
+}
+
+static int scan_next_record(Lua L)
+{
+    struct scan *scan = check_scan(L);
+    free(scan->cur);
+    scan->cur = NULL;
+    pthread_mutex_lock(&scan->lock);
+    int rc = scan->ordered ? scan_next_ordered(scan) : scan_next_unordered(scan);
+    pthread_mutex_unlock(&scan->lock);
+    if (rc == -1) return luacdb2_error(L, "parallel_scan: bad order_by column");
+    if (rc < 0) return luacdb2_error(L, "parallel_scan: order_by column must be integer, real, string or blob");
+    if (scan->rc) return luacdb2_error(L, "parallel_scan rc:%d err:%s", scan->rc, scan->errstr);
+    lua_pushboolean(L, rc);
+    return 1;
+}
+
+static int scan_column_value(Lua L)
+{
+    struct scan *scan = check_scan(L);
+    if (!scan->cur) return luacdb2_error(L, no_active_stmt);
+    int column = luaL_checkinteger(L, 2) - 1;
+    if (column < 0 || column >= scan->cur->ncols) return luaL_argerror(L, 2, "bad column");
+    struct scan_cell *c = &scan->cur->cells[column];
+    if (push_value(L, c->type, c->val, c->size) != 0) {
+        return luacdb2_error(L, "unsupported column type for '%s'", scan->names[column]);
+    }
+    return 1;
+}
+
+static int scan_column_name(Lua L)
+{
+    struct scan *scan = check_scan(L);
+    if (!scan->cur) return luacdb2_error(L, no_active_stmt);
+    int column = luaL_checkinteger(L, 2) - 1;
+    if (column < 0 || column >= scan->ncols) return luaL_argerror(L, 2, "bad column");
+    lua_pushstring(L, scan->names[column]);
+    return 1;
+}
+
+static int scan_num_columns(Lua L)
+{
+    struct scan *scan = check_scan(L);
+    if (!scan->cur) return luacdb2_error(L, no_active_stmt);
+    lua_pushinteger(L, scan->cur->ncols);
+    return 1;
+}
+
+static int scan_gc(Lua L)
+{
+    if (die) return 0;
+    struct scan **ud = luaL_checkudata(L, 1, "cdb2scan");
+    if (*ud) scan_free(*ud);
+    *ud = NULL;
+    return 0;
+}
+
+static int get_effects(Lua L)
+{
+    struct cdb2 *cdb2 = luaL_checkudata(L, 1, "cdb2");
+    drain_wait(L, cdb2);
+    if (cdb2->running) return luacdb2_error(L, have_active_stmt);
+    cdb2_effects_tp e;
+    cdb2_get_effects(cdb2->db, &e);
+
+    lua_newtable(L);
+    lua_pushstring(L, "num_inserted");
+    lua_pushinteger(L, e.num_inserted);
+    lua_settable(L, -3);
+    lua_pushstring(L, "num_updated");
+    lua_pushinteger(L, e.num_updated);
+    lua_settable(L, -3);
+    lua_pushstring(L, "num_deleted");
+    lua_pushinteger(L, e.num_deleted);
+    lua_settable(L, -3);
+    return 1;
+}
+
+static int last_err(Lua L)
+{
+    struct cdb2 *cdb2 = luaL_checkudata(L, 1, "cdb2");
+    drain_wait(L, cdb2);
+    if (cdb2->running) return luacdb2_error(L, have_active_stmt);
+    lua_pushstring(L, cdb2->errstr);
+    return 1;
+}
+
+static int next_record(Lua L)
+{
+    struct cdb2 *cdb2 = luaL_checkudata(L, 1, "cdb2");
+    if (!cdb2->running) return luacdb2_error(L, no_active_stmt);
+    if (cdb2->async) {
+        pthread_mutex_lock(&cdb2->lock);
+        cdb2_wait(cdb2);
+        pthread_mutex_unlock(&cdb2->lock);
+        if (cdb2->rc != 0) {
+            return luacdb2_error(L, "async cdb2_run_statement rc:%d err:%s", cdb2->rc, cdb2_errstr(cdb2->db));
+        }
+    }
+    int rc = cdb2_next_record(cdb2->db);
+    row_invalidate(cdb2);
+    cdb2->has_row = rc == CDB2_OK;
+    if (rc != CDB2_OK) record_async_wr(cdb2, rc);
+    if (rc == CDB2_OK) {
+        lua_pushboolean(L, 1);
+    } else if (rc == CDB2_OK_DONE) {
+        cdb2->running = 0;
+        lua_pushboolean(L, 0);
+    } else {
+        cdb2->running = 0;
+        return luacdb2_error(L, cdb2_errstr(cdb2->db));
+    }
+    return 1;
+}
+
+static int num_columns(Lua L)
+{
+    struct cdb2 *cdb2 = luaL_checkudata(L, 1, "cdb2");
+    if (!cdb2->running) {
+        return luacdb2_error(L, no_active_stmt);
+    }
+    lua_pushinteger(L, cdb2_numcolumns(cdb2->db));
+    return 1;
+}
+
+static int rd_stmt_int(Lua L, int fail)
+{
+    struct cdb2 *cdb2 = luaL_checkudata(L, 1, "cdb2");
+    drain_wait(L, cdb2);
+    if (cdb2->running) {
+        return luacdb2_error(L, have_active_stmt);
+    }
+    row_invalidate(cdb2);
+    const char *sql = luaL_checkstring(L, 2);
+    cdb2->read_stmt = 1;
+    if (cdb2->async) {
+        cdb2_dispatch(L, cdb2, sql, REC_RD);
+        lua_pushboolean(L, 1);
+        return 1;
+    }
+    int64_t start = now_us();
+    int rc = cdb2_run_statement(cdb2->db, sql);
+    record_stmt(cdb2, REC_RD, sql, start, rc);
+    if (rc != 0) {
+        if (fail) return luacdb2_error(L, cdb2_errstr(cdb2->db));
+        fprintf(stderr, "%s\n", cdb2_errstr(cdb2->db));
+        lua_pushboolean(L, 0);
+        return 1;
+    }
+    clear_params(cdb2);
+    cdb2->running = 1;
+    if (fail) return 0;
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+static int rd_stmt(Lua L)
+{
+    return rd_stmt_int(L, 1);
+}
+
+static int run_statement(Lua L)
+{
+    return rd_stmt_int(L, 1);
+}
+
+static int try_rd_stmt(Lua L)
+{
+    return rd_stmt_int(L, 0);
+}
+
+static int expect_err(Lua L, int expected)
+{
+    int rc;
+    struct cdb2 *cdb2 = luaL_checkudata(L, 1, "cdb2");
+    const char *sql = luaL_checkstring(L, 2);
+    drain_wait(L, cdb2);
+    if (cdb2->running) {
+            return luacdb2_error(L, have_active_stmt);
+    }
+    int64_t start = now_us();
+    rc = cdb2_run_statement(cdb2->db, sql);
+    if (rc == 0) {
+        while ((rc = cdb2_next_record(cdb2->db)) == CDB2_OK)
+            ;
+        if (rc == CDB2_OK_DONE) rc = 0;
+    }
+    record_stmt(cdb2, REC_ERR, sql, start, rc);
+    clear_params(cdb2);
+    if (rc == 0) {
+        lua_pushboolean(L, 0);
+        return 1;
+    }
+    if (rc != expected) {
+        return luacdb2_error(L, "expected:%d rc:%d err:%s", expected, rc, cdb2_errstr(cdb2->db));
+    }
+    free(cdb2->errstr);
+    cdb2->errstr = strdup(cdb2_errstr(cdb2->db));
+    cdb2->running = 0;
+    cdb2_close(cdb2->db);
+    cdb2_open(&cdb2->db, cdb2->dbname, cdb2->tier, 0);
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+static int duplicate_err(Lua L)
+{
+    return expect_err(L, CDB2ERR_DUPLICATE);
+}
+
+static int verify_err(Lua L)
+{
+    return expect_err(L, CDB2ERR_VERIFY_ERROR);
+}
+
+static int querylimit_err(Lua L)
+{
+    return expect_err(L, CDB2ERR_QUERYLIMIT);
+}
+
+static int readonly_err(Lua L)
+{
+    return expect_err(L, CDB2ERR_READONLY);
+}
+
+static int wr_stmt(Lua L)
+{
+    struct cdb2 *cdb2 = luaL_checkudata(L, 1, "cdb2");
+    drain_wait(L, cdb2);
+    if (cdb2->running) {
+        return luacdb2_error(L, have_active_stmt);
+    }
+    const char *sql = luaL_checkstring(L, 2);
+    cdb2->read_stmt = 0;
     if (cdb2->async) {
-        cdb2_dispatch(L, cdb2, sql);
+        cdb2_dispatch(L, cdb2, sql, REC_WR);
         return 0;
     }
+    int64_t start = now_us();
     int rc = cdb2_run_statement(cdb2->db, sql);
+    if (rc == 0) {
+        /* not drained_rows: see count_drained */
+        while ((rc = cdb2_next_record(cdb2->db)) == CDB2_OK)
+            ;
+        if (rc == CDB2_OK_DONE) rc = 0;
+    }
+    record_stmt(cdb2, REC_WR, sql, start, rc);
+    clear_params(cdb2);
     if (rc) {
         return luacdb2_error(L, "rc:%d err:%s", rc, cdb2_errstr(cdb2->db));
     }
-    clear_params(cdb2);
-    cdb2->running = 1;
-    drain(L);
     return 0;
 }
 
-static void get_timeval(Lua L, int idx, struct timeval *t)
+static void get_timeval(Lua L, int idx, struct timeval *t)
+{
+    luaL_checktype(L, idx, LUA_TTABLE);
+
+    lua_pushstring(L, "sec");
+    lua_gettable(L, idx);
+    t->tv_sec = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+
+    lua_pushstring(L, "usec");
+    lua_gettable(L, idx);
+    t->tv_usec = lua_tointeger(L, -1);
+    lua_pop(L, 1);
+}
+
+static void push_timeval(Lua L, struct timeval *t)
+{
+    lua_newtable(L);
+    lua_pushstring(L, "sec");
+    lua_pushnumber(L, t->tv_sec);
+    lua_settable(L, -3);
+    lua_pushstring(L, "usec");
+    lua_pushnumber(L, t->tv_usec);
+    lua_settable(L, -3);
+}
+
+static int luacdb2_gettimeofday(Lua L)
+{
+    struct timeval t;
+    gettimeofday(&t, NULL);
+    push_timeval(L, &t);
+    return 1;
+}
+
+static int luacdb2_timeradd(Lua L)
+{
+    struct timeval first, second, sum;
+    get_timeval(L, 1, &first);
+    get_timeval(L, 2, &second);
+    timeradd(&first, &second, &sum);
+    push_timeval(L, &sum);
+    return 1;
+}
+
+static int luacdb2_timersub(Lua L)
+{
+    struct timeval start, end, diff;
+    get_timeval(L, 1, &end);
+    get_timeval(L, 2, &start);
+    timersub(&end, &start, &diff);
+    push_timeval(L, &diff);
+    return 1;
+}
+
+static int luacdb2_sleep(Lua L)
+{
+    int sec = luaL_checkinteger(L, 1);
+    sleep(sec);
+    return 0;
+}
+
+static int luacdb2_sleepms(Lua L)
+{
+    int ms = luaL_checkinteger(L, 1);
+    if (ms) poll(NULL, 0, ms);
+    return 0;
+}
+
+static int luacdb2_setenv(Lua L)
+{
+    const char *key = luaL_checkstring(L, 1);
+    const char *val = luaL_checkstring(L, 2);
+    setenv(key, val, 1);
+    return 0;
+}
+
+static int guid(Lua L)
+{
+    uuid_t id;
+    char id_str[37];
+    uuid_generate(id);
+    uuid_unparse_lower(id, id_str);
+    lua_pushstring(L, id_str);
+    return 1;
+}
+
+/*
+ * Lua allocator: small blocks come from per-thread size-class free lists
+ * carved out of POOL_SLAB sized slabs; anything larger than POOL_MAX goes to
+ * libc. Lua always hands back the block size (osize) on free/realloc, so
+ * blocks carry no header. Slabs are only returned to libc by pool_release().
+ */
+#define POOL_QUANTUM 16
+#define POOL_MAX 256
+#define POOL_CLASSES (POOL_MAX / POOL_QUANTUM)
+#define POOL_SLAB (64 * 1024)
+#define pool_class(sz) (((sz) - 1) / POOL_QUANTUM)
+#define pool_class_size(c) (((c) + 1) * POOL_QUANTUM)
+
+struct pool_block {
+    struct pool_block *next;
+};
+
+struct pool_slab {
+    struct pool_slab *next;
+    uint8_t pad[POOL_QUANTUM - sizeof(struct pool_slab *)];
+};
+
+struct pool {
+    struct pool_block *free[POOL_CLASSES];
+    struct pool_slab *slabs;
+    uint64_t nslabs;
+    uint64_t allocs[POOL_CLASSES];
+    uint64_t frees[POOL_CLASSES];
+    uint64_t large_allocs;
+    uint64_t large_frees;
+    uint64_t reallocs;
+    uint64_t bytes; /* requested bytes currently held by Lua */
+    uint64_t peak;
+};
+
+static __thread struct pool pool;
+
+static int pool_refill(int c)
+{
+    struct pool_slab *slab = malloc(POOL_SLAB);
+    if (!slab) return -1;
+    slab->next = pool.slabs;
+    pool.slabs = slab;
+    ++pool.nslabs;
+    size_t sz = pool_class_size(c);
+    uint8_t *b = (uint8_t *)(slab + 1);
+    uint8_t *end = (uint8_t *)slab + POOL_SLAB;
+    for (; b + sz <= end; b += sz) {
+        struct pool_block *blk = (struct pool_block *)b;
+        blk->next = pool.free[c];
+        pool.free[c] = blk;
+    }
+    return 0;
+}
+
+static void *pool_get(size_t sz)
+{
+    void *ptr;
+    if (sz > POOL_MAX) {
+        if ((ptr = malloc(sz)) == NULL) return NULL;
+        ++pool.large_allocs;
+    } else {
+        int c = pool_class(sz);
+        if (!pool.free[c] && pool_refill(c) != 0) return NULL;
+        ptr = pool.free[c];
+        pool.free[c] = pool.free[c]->next;
+        ++pool.allocs[c];
+    }
+    pool.bytes += sz;
+    if (pool.bytes > pool.peak) pool.peak = pool.bytes;
+    return ptr;
+}
+
+static void pool_put(void *ptr, size_t sz)
+{
+    pool.bytes -= sz;
+    if (sz > POOL_MAX) {
+        ++pool.large_frees;
+        free(ptr);
+        return;
+    }
+    int c = pool_class(sz);
+    struct pool_block *blk = ptr;
+    blk->next = pool.free[c];
+    pool.free[c] = blk;
+    ++pool.frees[c];
+}
+
+static void *pool_alloc(void *ud, void *ptr, size_t osize, size_t nsize)
+{
+    (void)ud;
+    if (nsize == 0) {
+        if (ptr) pool_put(ptr, osize);
+        return NULL;
+    }
+    if (ptr == NULL) return pool_get(nsize);
+    ++pool.reallocs;
+    if (osize > POOL_MAX && nsize > POOL_MAX) {
+        void *tmp = realloc(ptr, nsize);
+        if (tmp) pool.bytes = pool.bytes - osize + nsize;
+        return tmp;
+    }
+    if (osize <= POOL_MAX && nsize <= POOL_MAX && pool_class(osize) == pool_class(nsize)) {
+        pool.bytes = pool.bytes - osize + nsize;
+        return ptr;
+    }
+    void *tmp = pool_get(nsize);
+    if (!tmp) {
+        /* Lua assumes shrinking never fails; old block is big enough */
+        return nsize < osize ? ptr : NULL;
+    }
+    memcpy(tmp, ptr, osize < nsize ? osize : nsize);
+    pool_put(ptr, osize);
+    return tmp;
+}
+
+static void pool_release(void)
+{
+    while (pool.slabs) {
+        struct pool_slab *slab = pool.slabs;
+        pool.slabs = slab->next;
+        free(slab);
+    }
+    memset(&pool, 0, sizeof(pool));
+}
+
+static int panic(Lua L)
+{
+    fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n", lua_tostring(L, -1));
+    return 0;
+}
+
+static int alloc_stats(Lua L)
 {
-    luaL_checktype(L, idx, LUA_TTABLE);
+    uint64_t allocs = 0, frees = 0;
+    lua_newtable(L);
+    lua_newtable(L);
+    for (int c = 0; c < POOL_CLASSES; ++c) {
+        allocs += pool.allocs[c];
+        frees += pool.frees[c];
+        lua_newtable(L);
+        lua_pushinteger(L, pool.allocs[c]);
+        lua_setfield(L, -2, "allocs");
+        lua_pushinteger(L, pool.frees[c]);
+        lua_setfield(L, -2, "frees");
+        lua_pushinteger(L, pool.allocs[c] - pool.frees[c]);
+        lua_setfield(L, -2, "in_use");
+        lua_rawseti(L, -2, pool_class_size(c));
+    }
+    lua_setfield(L, -2, "classes");
+    lua_pushinteger(L, allocs);
+    lua_setfield(L, -2, "allocs");
+    lua_pushinteger(L, frees);
+    lua_setfield(L, -2, "frees");
+    lua_pushinteger(L, pool.large_allocs);
+    lua_setfield(L, -2, "large_allocs");
+    lua_pushinteger(L, pool.large_frees);
+    lua_setfield(L, -2, "large_frees");
+    lua_pushinteger(L, pool.reallocs);
+    lua_setfield(L, -2, "reallocs");
+    lua_pushinteger(L, pool.bytes);
+    lua_setfield(L, -2, "bytes");
+    lua_pushinteger(L, pool.peak);
+    lua_setfield(L, -2, "peak");
+    lua_pushinteger(L, pool.nslabs);
+    lua_setfield(L, -2, "slabs");
+    lua_pushinteger(L, pool.nslabs * POOL_SLAB);
+    lua_setfield(L, -2, "slab_bytes");
+    return 1;
+}
 
-    lua_pushstring(L, "sec");
-    lua_gettable(L, idx);
-    t->tv_sec = lua_tointeger(L, -1);
-    lua_pop(L, 1);
+static int gc_mode(Lua L)
+{
+    const char *mode = NULL;
+    int pause = -1, stepmul = -1;
+    if (lua_type(L, 1) == LUA_TSTRING) {
+        mode = lua_tostring(L, 1);
+    } else {
+        luaL_checktype(L, 1, LUA_TTABLE);
+        lua_rawgeti(L, 1, 1);
+        mode = lua_tostring(L, -1);
+        lua_getfield(L, 1, "pause");
+        if (!lua_isnil(L, -1)) pause = luaL_checkinteger(L, -1);
+        lua_getfield(L, 1, "stepmul");
+        if (!lua_isnil(L, -1)) stepmul = luaL_checkinteger(L, -1);
+        lua_pop(L, 3);
+    }
+    if (mode == NULL || strcmp(mode, "incremental") == 0) {
+#if LUA_VERSION_NUM >= 504
+        lua_gc(L, LUA_GCINC, pause < 0 ? 0 : pause, stepmul < 0 ? 0 : stepmul, 0);
+#else
+        if (pause >= 0) lua_gc(L, LUA_GCSETPAUSE, pause);
+        if (stepmul >= 0) lua_gc(L, LUA_GCSETSTEPMUL, stepmul);
+#endif
+    } else if (strcmp(mode, "generational") == 0) {
+#if LUA_VERSION_NUM >= 504
+        lua_gc(L, LUA_GCGEN, 0, 0);
+        (void)pause;
+        (void)stepmul;
+#else
+        return luacdb2_error(L, "gc_mode: generational gc needs lua 5.4");
+#endif
+    } else {
+        return luaL_argerror(L, 1, "expected generational or incremental");
+    }
+    return 0;
+}
 
-    lua_pushstring(L, "usec");
-    lua_gettable(L, idx);
-    t->tv_usec = lua_tointeger(L, -1);
-    lua_pop(L, 1);
+static int gc_pause(Lua L)
+{
+    lua_gc(L, LUA_GCSTOP, 0);
+    return 0;
 }
 
-static void push_timeval(Lua L, struct timeval *t)
+static int gc_resume(Lua L)
 {
-    lua_newtable(L);
-    lua_pushstring(L, "sec");
-    lua_pushnumber(L, t->tv_sec);
-    lua_settable(L, -3);
-    lua_pushstring(L, "usec");
-    lua_pushnumber(L, t->tv_usec);
-    lua_settable(L, -3);
+    lua_gc(L, LUA_GCRESTART, 0);
+    return 0;
 }
 
-static int luacdb2_gettimeofday(Lua L)
+/*
+ * Fan-out mode (--procs N): each worker process gets a slot in a shared
+ * anonymous mapping and only ever writes to its own slot, so no locking is
+ * needed. The parent merges slots by name once all workers have exited.
+ * Without --procs, the same API writes to a private slot.
+ */
+#define SHM_NAME_LEN 32
+#define SHM_COUNTERS 64
+#define SHM_HISTOGRAMS 16
+#define SHM_RET_LEN 256
+#define HIST_SUB 8 /* linear sub-buckets per power of two */
+#define HIST_BUCKETS (64 * HIST_SUB)
+
+struct shm_counter {
+    char name[SHM_NAME_LEN];
+    int64_t value;
+};
+
+struct shm_histogram {
+    char name[SHM_NAME_LEN];
+    int64_t count;
+    int64_t sum;
+    int64_t min;
+    int64_t max;
+    int64_t buckets[HIST_BUCKETS];
+};
+
+struct shm_worker {
+    pid_t pid;
+    int rc;
+    int done;
+    int n_counters;
+    int n_histograms;
+    struct shm_counter counters[SHM_COUNTERS];
+    struct shm_histogram histograms[SHM_HISTOGRAMS];
+    char ret[SHM_RET_LEN];
+};
+
+static int n_procs = 1;
+static int worker = 0; /* 1..n_procs in fan-out mode */
+static struct shm_worker *self;
+
+static int hist_bucket(int64_t v)
 {
-    struct timeval t;
-    gettimeofday(&t, NULL);
-    push_timeval(L, &t);
-    return 1;
+    if (v < HIST_SUB) return v < 0 ? 0 : v;
+    int e = 63 - __builtin_clzll(v);
+    return (e - 2) * HIST_SUB + ((v >> (e - 3)) & (HIST_SUB - 1));
 }
 
-static int luacdb2_timeradd(Lua L)
+static int64_t hist_bucket_max(int b)
 {
-    struct timeval first, second, sum;
-    get_timeval(L, 1, &first);
-    get_timeval(L, 2, &second);
-    timeradd(&first, &second, &sum);
-    push_timeval(L, &sum);
-    return 1;
+    if (b < HIST_SUB) return b;
+    int e = b / HIST_SUB + 2;
+    int64_t lo = (int64_t)(HIST_SUB + b % HIST_SUB) << (e - 3);
+    return lo + ((int64_t)1 << (e - 3)) - 1;
 }
 
-static int luacdb2_timersub(Lua L)
+static int worker_id(Lua L)
 {
-    struct timeval start, end, diff;
-    get_timeval(L, 1, &end);
-    get_timeval(L, 2, &start);
-    timersub(&end, &start, &diff);
-    push_timeval(L, &diff);
+    lua_pushinteger(L, worker);
     return 1;
 }
 
-static int luacdb2_sleep(Lua L)
+static int procs(Lua L)
 {
-    int sec = luaL_checkinteger(L, 1);
-    sleep(sec);
-    return 0;
+    lua_pushinteger(L, n_procs);
+    return 1;
 }
 
-static int luacdb2_sleepms(Lua L)
+static int counter(Lua L)
 {
-    int ms = luaL_checkinteger(L, 1);
-    if (ms) poll(NULL, 0, ms);
-    return 0;
+    size_t len;
+    const char *name = luaL_checklstring(L, 1, &len);
+    if (len >= SHM_NAME_LEN) return luaL_argerror(L, 1, "name too long");
+    int64_t delta = luaL_optinteger(L, 2, 1);
+    int i;
+    for (i = 0; i < self->n_counters; ++i) {
+        if (strcmp(self->counters[i].name, name) == 0) break;
+    }
+    if (i == self->n_counters) {
+        if (i == SHM_COUNTERS) return luacdb2_error(L, "too many counters");
+        strncpy(self->counters[i].name, name, SHM_NAME_LEN - 1);
+        ++self->n_counters;
+    }
+    self->counters[i].value += delta;
+    lua_pushinteger(L, self->counters[i].value);
+    return 1;
 }
 
-static int luacdb2_setenv(Lua L)
+static int histogram(Lua L)
 {
-    const char *key = luaL_checkstring(L, 1);
-    const char *val = luaL_checkstring(L, 2);
-    setenv(key, val, 1);
+    size_t len;
+    const char *name = luaL_checklstring(L, 1, &len);
+    if (len >= SHM_NAME_LEN) return luaL_argerror(L, 1, "name too long");
+    int64_t v = luaL_checkinteger(L, 2);
+    if (v < 0) v = 0;
+    int i;
+    for (i = 0; i < self->n_histograms; ++i) {
+        if (strcmp(self->histograms[i].name, name) == 0) break;
+    }
+    if (i == self->n_histograms) {
+        if (i == SHM_HISTOGRAMS) return luacdb2_error(L, "too many histograms");
+        strncpy(self->histograms[i].name, name, SHM_NAME_LEN - 1);
+        self->histograms[i].min = INT64_MAX;
+        ++self->n_histograms;
+    }
+    struct shm_histogram *h = &self->histograms[i];
+    ++h->count;
+    h->sum += v;
+    if (v < h->min) h->min = v;
+    if (v > h->max) h->max = v;
+    ++h->buckets[hist_bucket(v)];
     return 0;
 }
 
-static int guid(Lua L)
+static int record(Lua L)
 {
-    uuid_t id;
-    char id_str[37];
-    uuid_generate(id);
-    uuid_unparse_lower(id, id_str);
-    lua_pushstring(L, id_str);
-    return 1;
+    record_stop();
+    if (lua_isnoneornil(L, 1)) return 0;
+    const char *path = luaL_checkstring(L, 1);
+    char *file = alloca(strlen(path) + 16);
+    if (worker) {
+        sprintf(file, "%s.%d", path, worker);
+    } else {
+        strcpy(file, path);
+    }
+    FILE *f = fopen(file, "w");
+    if (!f) return luacdb2_error(L, "record: failed to open %s", file);
+    fwrite(REC_MAGIC, 1, strlen(REC_MAGIC), f);
+    pthread_mutex_lock(&rec.lock);
+    rec.f = f;
+    ++rec.gen;
+    rec.start = now_us();
+    pthread_mutex_unlock(&rec.lock);
+    return 0;
 }
 
 static void init_cdb2(Lua L)
@@ -770,15 +2631,53 @@ static void init_cdb2(Lua L)
     lua_pushcfunction(L, guid);
     lua_setglobal(L, "guid");
 
+    lua_pushcfunction(L, parallel_scan);
+    lua_setglobal(L, "parallel_scan");
+
+    lua_pushcfunction(L, drained_rows);
+    lua_setglobal(L, "drained_rows");
+
+    lua_pushcfunction(L, record);
+    lua_setglobal(L, "record");
+
+    lua_pushcfunction(L, worker_id);
+    lua_setglobal(L, "worker_id");
+
+    lua_pushcfunction(L, procs);
+    lua_setglobal(L, "procs");
+
+    lua_pushcfunction(L, counter);
+    lua_setglobal(L, "counter");
+
+    lua_pushcfunction(L, histogram);
+    lua_setglobal(L, "histogram");
+
+    lua_pushcfunction(L, alloc_stats);
+    lua_setglobal(L, "alloc_stats");
+
+    lua_pushcfunction(L, gc_mode);
+    lua_setglobal(L, "gc_mode");
+
+    lua_pushcfunction(L, gc_pause);
+    lua_setglobal(L, "gc_pause");
+
+    lua_pushcfunction(L, gc_resume);
+    lua_setglobal(L, "gc_resume");
+
     const struct luaL_Reg cdb2_funcs[] = {
         {"__gc", __gc},
+        {"abandon", abandon},
+        {"auto_abandon", auto_abandon},
         {"bind", cdb2_bind},
         {"bind_blob", bind_blob},
+        {"busy", busy},
         {"close", __gc},
         {"column_name", column_name},
         {"column_type", column_type},
         {"column_value", column_value},
         {"drain", drain},
+        {"drained_rows", drained_rows},
+        {"fetch_columns", fetch_columns},
         {"duplicate_err", duplicate_err},
         {"get_effects", get_effects},
         {"last_err", last_err},
@@ -787,6 +2686,7 @@ static void init_cdb2(Lua L)
         {"querylimit_err", querylimit_err},
         {"readonly_err", readonly_err},
         {"rd_stmt", rd_stmt},
+        {"row", row},
         {"run_statement", run_statement},
         {"try_rd_stmt", try_rd_stmt},
         {"verify_err", verify_err},
@@ -798,14 +2698,403 @@ static void init_cdb2(Lua L)
     lua_setfield(L, -2, "__index");
     luaL_setfuncs(L, cdb2_funcs, 0);
     lua_pop(L, 1);
+
+    const struct luaL_Reg vec_funcs[] = {
+        {"__gc", vec_gc},
+        {"__index", vec_index},
+        {"__len", vec_len},
+        {"count_nulls", vec_nulls},
+        {"hash", vec_hash},
+        {"max", vec_max},
+        {"min", vec_min},
+        {"name", vec_name},
+        {"percentile", vec_percentile},
+        {"size", vec_len},
+        {"sort", vec_sort},
+        {"sum", vec_sum},
+        {"type", vec_type},
+        {NULL, NULL}
+    };
+    luaL_newmetatable(L, "cdb2vec");
+    luaL_setfuncs(L, vec_funcs, 0);
+    lua_pop(L, 1);
+
+    const struct luaL_Reg row_funcs[] = {
+        {"__index", row_index},
+        {"__len", row_len},
+        {NULL, NULL}
+    };
+    luaL_newmetatable(L, "cdb2row");
+    luaL_setfuncs(L, row_funcs, 0);
+    lua_pop(L, 1);
+
+    const struct luaL_Reg scan_funcs[] = {
+        {"__gc", scan_gc},
+        {"close", scan_gc},
+        {"column_name", scan_column_name},
+        {"column_value", scan_column_value},
+        {"next_record", scan_next_record},
+        {"num_columns", scan_num_columns},
+        {NULL, NULL}
+    };
+    luaL_newmetatable(L, "cdb2scan");
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    luaL_setfuncs(L, scan_funcs, 0);
+    lua_pop(L, 1);
 }
 
-int main(int argc, char **argv)
+/*
+ * Replay (--replay path): statements are grouped by recorded handle and each
+ * recorded handle is pinned to one of --handles threads, so statements on a
+ * handle (and any transaction they form) are re-issued in order on a single
+ * connection. Each statement waits until its recorded start offset divided
+ * by --speed.
+ */
+struct replay_param {
+    int idx;
+    int type;
+    int len;
+    char *name;
+    void *val;
+};
+
+struct replay_stmt {
+    int kind;
+    int handle; /* index into replay.handles */
+    int seq; /* load order; keeps qsort stable on equal starts */
+    int64_t start;
+    int64_t dur;
+    int rc;
+    char *sql;
+    int n_params;
+    struct replay_param *params;
+
+    int64_t replay_dur;
+    int64_t lag;
+    int replay_rc;
+};
+
+struct replay_handle {
+    uint32_t id;
+    int flags;
+    char *dbname;
+    char *tier;
+    cdb2_hndl_tp *db;
+};
+
+static struct {
+    double speed;
+    int n_threads;
+    const char *dbname; /* overrides recorded dbname/tier */
+    const char *tier;
+    int n_handles;
+    struct replay_handle *handles;
+    int n_stmts;
+    struct replay_stmt *stmts;
+    int64_t start;
+} replay = { .speed = 1, .n_threads = 1 };
+
+struct replay_reader {
+    const uint8_t *p;
+    const uint8_t *end;
+};
+
+static int replay_get(struct replay_reader *r, void *v, size_t sz)
 {
-    char *config_file = getenv("CDB2_CONFIG");
-    if (config_file) cdb2_set_comdb2db_config(config_file);
-    signal(SIGPIPE, SIG_IGN);
-    Lua L = luaL_newstate();
+    if ((size_t)(r->end - r->p) < sz) return -1;
+    memcpy(v, r->p, sz);
+    r->p += sz;
+    return 0;
+}
+
+static char *replay_get_str(struct replay_reader *r, size_t len)
+{
+    if ((size_t)(r->end - r->p) < len) return NULL;
+    char *s = malloc(len + 1);
+    memcpy(s, r->p, len);
+    s[len] = 0;
+    r->p += len;
+    return s;
+}
+
+static int replay_find_handle(uint32_t id)
+{
+    for (int i = replay.n_handles - 1; i >= 0; --i) {
+        if (replay.handles[i].id == id) return i;
+    }
+    return -1;
+}
+
+#define replay_read(v) if (replay_get(&r, &(v), sizeof(v)) != 0) goto bad
+
+static int replay_load(const char *path)
+{
+    FILE *f = fopen(path, "r");
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    fseek(f, 0, SEEK_END);
+    long sz = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    uint8_t *buf = malloc(sz);
+    if (fread(buf, 1, sz, f) != (size_t)sz) {
+        perror(path);
+        fclose(f);
+        free(buf);
+        return -1;
+    }
+    fclose(f);
+    struct replay_reader r = { buf, buf + sz };
+    size_t magic = strlen(REC_MAGIC);
+    if ((size_t)sz < magic || memcmp(buf, REC_MAGIC, magic) != 0) goto bad;
+    r.p += magic;
+    int cap = 0;
+    while (r.p < r.end) {
+        uint8_t kind;
+        uint32_t id;
+        replay_read(kind);
+        replay_read(id);
+        if (kind == REC_HANDLE) {
+            int32_t flags;
+            uint16_t len;
+            replay_read(flags);
+            replay.handles = realloc(replay.handles, (replay.n_handles + 1) * sizeof(struct replay_handle));
+            struct replay_handle *h = &replay.handles[replay.n_handles++];
+            memset(h, 0, sizeof(*h));
+            h->id = id;
+            h->flags = flags;
+            replay_read(len);
+            if ((h->dbname = replay_get_str(&r, len)) == NULL) goto bad;
+            replay_read(len);
+            if ((h->tier = replay_get_str(&r, len)) == NULL) goto bad;
+            continue;
+        }
+        if (kind != REC_RD && kind != REC_WR && kind != REC_ERR) goto bad;
+        if (replay.n_stmts == cap) {
+            cap = cap ? cap * 2 : 1024;
+            replay.stmts = realloc(replay.stmts, cap * sizeof(struct replay_stmt));
+        }
+        struct replay_stmt *s = &replay.stmts[replay.n_stmts];
+        memset(s, 0, sizeof(*s));
+        s->kind = kind;
+        s->seq = replay.n_stmts;
+        if ((s->handle = replay_find_handle(id)) < 0) goto bad;
+        int32_t rc;
+        uint32_t sql_len;
+        uint8_t n;
+        replay_read(s->start);
+        replay_read(s->dur);
+        replay_read(rc);
+        s->rc = rc;
+        replay_read(sql_len);
+        if ((s->sql = replay_get_str(&r, sql_len)) == NULL) goto bad;
+        replay_read(n);
+        s->params = calloc(n, sizeof(struct replay_param));
+        s->n_params = n;
+        ++replay.n_stmts;
+        for (int i = 0; i < n; ++i) {
+            struct replay_param *p = &s->params[i];
+            uint8_t idx, type, name_len;
+            int32_t len;
+            replay_read(idx);
+            replay_read(type);
+            replay_read(name_len);
+            if ((p->name = replay_get_str(&r, name_len)) == NULL) goto bad;
+            replay_read(len);
+            p->idx = idx;
+            p->type = type;
+            p->len = len;
+            if (len >= 0 && (p->val = replay_get_str(&r, len)) == NULL) goto bad;
+        }
+    }
+    free(buf);
+    return 0;
+bad:
+    fprintf(stderr, "%s: bad recording at offset %ld\n", path, (long)(r.p - buf));
+    free(buf);
+    return -1;
+}
+
+static void replay_sleep_until(int64_t us)
+{
+    struct timespec t = { .tv_sec = us / 1000000, .tv_nsec = us % 1000000 * 1000 };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &t, NULL) != 0)
+        ;
+}
+
+static int replay_open(struct replay_handle *h)
+{
+    const char *dbname = replay.dbname ? replay.dbname : h->dbname;
+    const char *tier = replay.tier ? replay.tier : h->tier;
+    int flags = replay.tier ? 0 : h->flags;
+    if (cdb2_open(&h->db, dbname, tier, flags) != 0) {
+        fprintf(stderr, "cdb2_open %s %s: %s\n", dbname, tier, cdb2_errstr(h->db));
+        cdb2_close(h->db);
+        h->db = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+static void replay_one(struct replay_stmt *s)
+{
+    struct replay_handle *h = &replay.handles[s->handle];
+    int64_t due = replay.start + (int64_t)(s->start / replay.speed);
+    replay_sleep_until(due);
+    s->lag = now_us() - due;
+    if (!h->db && replay_open(h) != 0) {
+        s->replay_rc = -1;
+        return;
+    }
+    for (int i = 0; i < s->n_params; ++i) {
+        struct replay_param *p = &s->params[i];
+        int len = p->len < 0 ? 0 : p->len;
+        if (p->name[0]) {
+            cdb2_bind_param(h->db, p->name, p->type, p->val, len);
+        } else {
+            cdb2_bind_index(h->db, p->idx, p->type, p->val, len);
+        }
+    }
+    int64_t start = now_us();
+    int rc = cdb2_run_statement(h->db, s->sql);
+    if (rc == 0 && s->kind == REC_RD) s->replay_dur = now_us() - start;
+    if (rc == 0) {
+        while ((rc = cdb2_next_record(h->db)) == CDB2_OK)
+            ;
+        if (rc == CDB2_OK_DONE) rc = 0;
+    }
+    if (s->kind != REC_RD || rc != 0) s->replay_dur = now_us() - start;
+    s->replay_rc = rc;
+    cdb2_clearbindings(h->db);
+    if (rc != 0) {
+        /* same as expect_err: don't reuse a handle after an error */
+        cdb2_close(h->db);
+        h->db = NULL;
+    }
+}
+
+static void *replay_worker(void *data)
+{
+    int t = (intptr_t)data;
+    for (int i = 0; i < replay.n_stmts; ++i) {
+        struct replay_stmt *s = &replay.stmts[i];
+        if (s->handle % replay.n_threads == t) replay_one(s);
+    }
+    for (int i = t; i < replay.n_handles; i += replay.n_threads) {
+        if (replay.handles[i].db) cdb2_close(replay.handles[i].db);
+        replay.handles[i].db = NULL;
+    }
+    return NULL;
+}
+
+static int cmp_replay_start(const void *a, const void *b)
+{
+    const struct replay_stmt *x = a, *y = b;
+    if (x->start != y->start) return (x->start > y->start) - (x->start < y->start);
+    if (x->handle != y->handle) return (x->handle > y->handle) - (x->handle < y->handle);
+    return (x->seq > y->seq) - (x->seq < y->seq);
+}
+
+static void replay_print(const char *what, int64_t *v, int n)
+{
+    qsort(v, n, sizeof(int64_t), cmp_int);
+    int64_t sum = 0;
+    for (int i = 0; i < n; ++i) sum += v[i];
+    printf("%s avg:%.1fus p50:%" PRId64 "us p90:%" PRId64 "us p99:%" PRId64 "us max:%" PRId64 "us\n",
+           what, (double)sum / n, v[n * 50 / 100], v[n * 90 / 100], v[n * 99 / 100], v[n - 1]);
+}
+
+static int replay_report(int64_t elapsed)
+{
+    int n = replay.n_stmts, mismatch = 0;
+    printf("replay statements:%d handles:%d threads:%d speed:%.2f elapsed:%.3fs\n",
+           n, replay.n_handles, replay.n_threads, replay.speed, elapsed / 1e6);
+    if (n == 0) return 0;
+    int64_t *recorded = malloc(n * sizeof(int64_t));
+    int64_t *replayed = malloc(n * sizeof(int64_t));
+    int64_t *lag = malloc(n * sizeof(int64_t));
+    for (int i = 0; i < n; ++i) {
+        struct replay_stmt *s = &replay.stmts[i];
+        recorded[i] = s->dur;
+        replayed[i] = s->replay_dur;
+        lag[i] = s->lag;
+        if ((s->rc == 0) != (s->replay_rc == 0)) {
+            if (mismatch++ < 10) {
+                fprintf(stderr, "rc mismatch recorded:%d replayed:%d sql:%s\n", s->rc, s->replay_rc, s->sql);
+            }
+        }
+    }
+    replay_print("recorded", recorded, n);
+    replay_print("replayed", replayed, n);
+    replay_print("start-lag", lag, n);
+    printf("rc-mismatch:%d\n", mismatch);
+    free(recorded);
+    free(replayed);
+    free(lag);
+    return mismatch ? 1 : 0;
+}
+
+static int replay_main(int argc, char **argv)
+{
+    const char *path = argv[0];
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--speed") == 0 && i + 1 < argc) {
+            replay.speed = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--handles") == 0 && i + 1 < argc) {
+            replay.n_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--db") == 0 && i + 1 < argc) {
+            replay.dbname = argv[++i];
+        } else if (strcmp(argv[i], "--tier") == 0 && i + 1 < argc) {
+            replay.tier = argv[++i];
+        } else {
+            fprintf(stderr, "--replay: unexpected argument %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (replay.speed <= 0 || replay.n_threads < 1) {
+        fprintf(stderr, "--replay: expected --speed > 0 and --handles >= 1\n");
+        return 1;
+    }
+    if (replay_load(path) != 0) return 1;
+    qsort(replay.stmts, replay.n_stmts, sizeof(struct replay_stmt), cmp_replay_start);
+    pthread_t *thds = malloc(replay.n_threads * sizeof(pthread_t));
+    replay.start = now_us();
+    for (int t = 0; t < replay.n_threads; ++t) {
+        pthread_create(&thds[t], NULL, replay_worker, (void *)(intptr_t)t);
+    }
+    for (int t = 0; t < replay.n_threads; ++t) {
+        pthread_join(thds[t], NULL);
+    }
+    int rc = replay_report(now_us() - replay.start);
+    free(thds);
+    for (int i = 0; i < replay.n_stmts; ++i) {
+        struct replay_stmt *s = &replay.stmts[i];
+        for (int j = 0; j < s->n_params; ++j) {
+            free(s->params[j].name);
+            free(s->params[j].val);
+        }
+        free(s->params);
+        free(s->sql);
+    }
+    for (int i = 0; i < replay.n_handles; ++i) {
+        free(replay.handles[i].dbname);
+        free(replay.handles[i].tier);
+    }
+    free(replay.stmts);
+    free(replay.handles);
+    return rc;
+}
+
+static int run_script(int argc, char **argv)
+{
+    Lua L = lua_newstate(pool_alloc, NULL);
+    if (!L) {
+        fprintf(stderr, "lua_newstate failed\n");
+        return 1;
+    }
+    lua_atpanic(L, panic);
     luaL_openlibs(L);
     init_cdb2(L);
     lua_newtable(L);
@@ -814,10 +3103,147 @@ int main(int argc, char **argv)
         lua_rawseti(L, -2, i - 1);
     }
     lua_setglobal(L, "argv");
-    int rc = luaL_dofile(L, argc > 1 ? argv[1] : NULL);
+    int rc = luaL_loadfile(L, argc > 1 ? argv[1] : NULL) || lua_pcall(L, 0, 1, 0);
     if (rc) {
         fprintf(stderr, "%s\n", lua_tostring(L, 1));
+    } else if (!lua_isnil(L, 1)) {
+        strncpy(self->ret, luaL_tolstring(L, 1, NULL), SHM_RET_LEN - 1);
     }
     lua_close(L);
+    record_stop();
+    pool_release();
+    return rc;
+}
+
+static struct shm_counter *find_counter(struct shm_counter *c, int n, const char *name)
+{
+    for (int i = 0; i < n; ++i) {
+        if (strcmp(c[i].name, name) == 0) return &c[i];
+    }
+    return NULL;
+}
+
+static struct shm_histogram *find_histogram(struct shm_histogram *h, int n, const char *name)
+{
+    for (int i = 0; i < n; ++i) {
+        if (strcmp(h[i].name, name) == 0) return &h[i];
+    }
+    return NULL;
+}
+
+static int64_t hist_percentile(struct shm_histogram *h, double p)
+{
+    int64_t rank = p / 100 * h->count;
+    int64_t seen = 0;
+    for (int b = 0; b < HIST_BUCKETS; ++b) {
+        seen += h->buckets[b];
+        if (seen > rank) return hist_bucket_max(b) < h->max ? hist_bucket_max(b) : h->max;
+    }
+    return h->max;
+}
+
+static void report(struct shm_worker *workers, int n)
+{
+    struct shm_worker *all = calloc(1, sizeof(struct shm_worker));
+    for (int w = 0; w < n; ++w) {
+        struct shm_worker *wk = &workers[w];
+        printf("worker:%d pid:%d rc:%d%s return:%s\n", w + 1, (int)wk->pid, wk->rc, wk->done ? "" : " (died)", wk->ret);
+        for (int i = 0; i < wk->n_counters; ++i) {
+            struct shm_counter *c = find_counter(all->counters, all->n_counters, wk->counters[i].name);
+            if (!c) {
+                if (all->n_counters == SHM_COUNTERS) continue;
+                c = &all->counters[all->n_counters++];
+                strcpy(c->name, wk->counters[i].name);
+            }
+            c->value += wk->counters[i].value;
+        }
+        for (int i = 0; i < wk->n_histograms; ++i) {
+            struct shm_histogram *src = &wk->histograms[i];
+            struct shm_histogram *h = find_histogram(all->histograms, all->n_histograms, src->name);
+            if (!h) {
+                if (all->n_histograms == SHM_HISTOGRAMS) continue;
+                h = &all->histograms[all->n_histograms++];
+                strcpy(h->name, src->name);
+                h->min = INT64_MAX;
+            }
+            h->count += src->count;
+            h->sum += src->sum;
+            if (src->min < h->min) h->min = src->min;
+            if (src->max > h->max) h->max = src->max;
+            for (int b = 0; b < HIST_BUCKETS; ++b) h->buckets[b] += src->buckets[b];
+        }
+    }
+    for (int i = 0; i < all->n_counters; ++i) {
+        printf("counter:%s total:%" PRId64 "\n", all->counters[i].name, all->counters[i].value);
+    }
+    for (int i = 0; i < all->n_histograms; ++i) {
+        struct shm_histogram *h = &all->histograms[i];
+        printf("histogram:%s count:%" PRId64 " min:%" PRId64 " max:%" PRId64 " avg:%.1f p50:%" PRId64 " p90:%" PRId64 " p99:%" PRId64 "\n",
+               h->name, h->count, h->min, h->max, (double)h->sum / h->count,
+               hist_percentile(h, 50), hist_percentile(h, 90), hist_percentile(h, 99));
+    }
+    free(all);
+}
+
+static int fan_out(int n, int argc, char **argv)
+{
+    size_t sz = n * sizeof(struct shm_worker);
+    struct shm_worker *workers = mmap(NULL, sz, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (workers == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    n_procs = n;
+    fflush(stdout);
+    fflush(stderr);
+    for (int w = 0; w < n; ++w) {
+        pid_t pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            n = w;
+            break;
+        }
+        if (pid == 0) {
+            worker = w + 1;
+            self = &workers[w];
+            self->pid = getpid();
+            self->rc = run_script(argc, argv);
+            self->done = 1;
+            fflush(stdout);
+            fflush(stderr);
+            _exit(self->rc);
+        }
+        workers[w].pid = pid;
+    }
+    int rc = 0, status;
+    for (int w = 0; w < n; ++w) {
+        waitpid(workers[w].pid, &status, 0);
+        if (!workers[w].done || workers[w].rc) rc = 1;
+    }
+    report(workers, n);
+    munmap(workers, sz);
+    return rc;
+}
+
+int main(int argc, char **argv)
+{
+    char *config_file = getenv("CDB2_CONFIG");
+    if (config_file) cdb2_set_comdb2db_config(config_file);
+    signal(SIGPIPE, SIG_IGN);
+    if (argc > 2 && strcmp(argv[1], "--procs") == 0) {
+        int n = atoi(argv[2]);
+        if (n < 1) {
+            fprintf(stderr, "--procs: expected a positive number of workers\n");
+            return 1;
+        }
+        argv[2] = argv[0];
+        return fan_out(n, argc - 2, argv + 2);
+    }
+    if (argc > 2 && strcmp(argv[1], "--replay") == 0) {
+        return replay_main(argc - 2, argv + 2);
+    }
+    self = calloc(1, sizeof(struct shm_worker));
+    int rc = run_script(argc, argv);
+    free(self);
     return rc;
 }